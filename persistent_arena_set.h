@@ -0,0 +1,798 @@
+#ifndef PERSISTENT_ARENA_SET_H
+#define PERSISTENT_ARENA_SET_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+// Persistent AVL set for large sets of small values. Nodes live in an arena shared by the
+// versions created from it and refer to their children by 32-bit indices; a node is the two
+// indices, a 32-bit word holding its reference count and height, and the value, so a node
+// of 4-byte values takes 16 bytes, with no allocator header. Freed nodes are reused by later
+// updates. The arena is not synchronized: all versions of one arena are used from one thread,
+// and it must outlive them. T must be nothrow copy constructible, which with the room an
+// update needs reserved up front makes every update either complete or leave the set as it
+// was. The interface follows persistent_set, except that an update which grows the arena
+// moves the values of all its versions: references to elements last until the next insert
+// or erase on the arena, unless arena::reserve made room for it.
+template<typename T, typename Allocator = std::allocator<T>, typename Compare = std::less<T>>
+struct persistent_arena_set {
+    static_assert(std::is_nothrow_copy_constructible<T>::value, "arena nodes are filled without rollback");
+
+    typedef T value_type;
+    typedef Allocator allocator_type;
+    typedef Compare key_compare;
+    typedef Compare value_compare;
+    typedef std::uint32_t index;
+    struct arena;
+
+    struct iterator;
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    // An AVL tree of height 46 holds at least F(48) - 1 > 2^32 nodes.
+    static constexpr std::size_t max_height = 46;
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    const_reverse_iterator rbegin() const;
+
+    const_reverse_iterator rend() const;
+
+    explicit persistent_arena_set(arena &a, Compare const &comp = Compare());
+
+    persistent_arena_set(persistent_arena_set const &other);
+
+    persistent_arena_set(persistent_arena_set &&other) noexcept;
+
+    persistent_arena_set &operator=(persistent_arena_set const &other);
+
+    persistent_arena_set &operator=(persistent_arena_set &&other) noexcept;
+
+    ~persistent_arena_set();
+
+    void clear();
+
+    bool empty() const;
+
+    size_t size() const;
+
+    void swap(persistent_arena_set &other);
+
+    arena &get_arena() const;
+
+    key_compare key_comp() const;
+
+    iterator find(T const &value) const;
+
+    size_t count(T const &value) const;
+
+    iterator lower_bound(T const &value) const;
+
+    iterator upper_bound(T const &value) const;
+
+    std::pair<iterator, bool> insert(T const &value);
+
+    void erase(iterator const &it);
+
+    size_t erase(T const &value);
+
+private:
+    struct node;
+
+    iterator bound(T const &value, bool upper) const;
+
+    index share(index v) const;
+
+    void release(index v) const;
+
+    index make_node(T const &value, index left, index right) const;
+
+    index take_left(index v) const;
+
+    index take_right(index v) const;
+
+    index rebuild(index self, index left, index right, iterator *track = nullptr) const;
+
+    index balance(index self, index left, index right, iterator *track = nullptr) const;
+
+    index insert_impl(index pos, T const &value, bool &inserted, iterator &at) const;
+
+    index erase_impl(index pos, T const &value, bool &erased) const;
+
+    index erase_min(index pos, index &minimum) const;
+
+    unsigned height(index v) const;
+
+    arena *nodes;
+
+    index root;
+
+    size_t _size;
+
+    Compare comp;
+};
+
+// `refs_height` keeps the reference count in its low 26 bits and the height above them.
+template<typename T, typename Allocator, typename Compare>
+struct persistent_arena_set<T, Allocator, Compare>::node {
+    index left;
+    index right;
+    std::uint32_t refs_height;
+    T value;
+
+    static constexpr unsigned refs_bits = 26;
+    static constexpr std::uint32_t refs_mask = (std::uint32_t(1) << refs_bits) - 1;
+
+    std::uint32_t refs() const {
+        return refs_height & refs_mask;
+    }
+
+    unsigned height() const {
+        return refs_height >> refs_bits;
+    }
+};
+
+// Node storage in one array, so index i is element i of it. Index 0 is never used and
+// stands for the empty subtree. The array doubles when it runs out of room, moving the
+// nodes; updates only let that happen while they reserve room, before they look at a node.
+template<typename T, typename Allocator, typename Compare>
+struct persistent_arena_set<T, Allocator, Compare>::arena {
+    explicit arena(Allocator const &alloc = Allocator())
+            : alloc(alloc), base(nullptr), capacity(0), next(1), free_list(0), free_count(0), live(0) {}
+
+    arena(arena const &) = delete;
+
+    arena &operator=(arena const &) = delete;
+
+    ~arena();
+
+    // Nodes in use by the versions of this arena.
+    size_t nodes() const;
+
+    // Bytes taken by the array.
+    size_t bytes() const;
+
+    // Makes room for `n` more nodes, so that the next `n` allocations neither throw nor move
+    // nodes.
+    void reserve(size_t n);
+
+private:
+    friend struct persistent_arena_set;
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<node> node_allocator;
+
+    static constexpr size_t min_capacity = 1024;
+    static constexpr size_t max_capacity = size_t(std::numeric_limits<index>::max()) + 1;
+
+    node &at(index i) {
+        return base[i];
+    }
+
+    // Whether `p` points into the array, which growing it would move.
+    bool holds(void const *p) const {
+        std::less<void const *> below;
+        return base && !below(p, base) && below(p, base + capacity);
+    }
+
+    void grow(size_t n);
+
+    index allocate();
+
+    void free(index i);
+
+    node_allocator alloc;
+    node *base;
+    size_t capacity;
+    // Slots from `next` to `capacity` have never been used; freed ones are linked through
+    // their `left` index and have no references.
+    size_t next;
+    index free_list;
+    size_t free_count;
+    size_t live;
+};
+
+template<typename T, typename Allocator, typename Compare>
+struct persistent_arena_set<T, Allocator, Compare>::iterator {
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = T const;
+    using pointer = T const *;
+    using reference = T const &;
+
+    iterator() = default;
+
+    reference operator*() const;
+
+    pointer operator->() const;
+
+    iterator &operator++();
+
+    iterator operator++(int);
+
+    iterator &operator--();
+
+    iterator operator--(int);
+
+    friend bool operator==(iterator const &a, iterator const &b) {
+        return a.depth == b.depth && (a.depth == 0 || a.path[a.depth - 1] == b.path[b.depth - 1]);
+    }
+
+    friend bool operator!=(iterator const &a, iterator const &b) {
+        return !(a == b);
+    }
+
+private:
+    friend struct persistent_arena_set;
+
+    iterator(arena *nodes, index root) : nodes(nodes), root(root), depth(0) {}
+
+    void leftmost(index v);
+
+    void rightmost(index v);
+
+    void follow(index self, index v);
+
+    arena *nodes;
+    index root;
+    // The current node on top, under its ancestors; empty at the end.
+    index path[max_height];
+    size_t depth;
+};
+
+template<typename T, typename Allocator, typename Compare>
+persistent_arena_set<T, Allocator, Compare>::arena::~arena() {
+    assert(live == 0);
+    if (base) {
+        std::allocator_traits<node_allocator>::deallocate(alloc, base, capacity);
+    }
+}
+
+template<typename T, typename Allocator, typename Compare>
+size_t persistent_arena_set<T, Allocator, Compare>::arena::nodes() const {
+    return live;
+}
+
+template<typename T, typename Allocator, typename Compare>
+size_t persistent_arena_set<T, Allocator, Compare>::arena::bytes() const {
+    return capacity * sizeof(node);
+}
+
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::arena::reserve(size_t n) {
+    if (n > free_count && n - free_count > capacity - std::min(next, capacity)) {
+        grow(next + (n - free_count));
+    }
+}
+
+// Moves the nodes to an array of at least `n` slots; freed slots have no value to move.
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::arena::grow(size_t n) {
+    if (n > max_capacity) {
+        throw std::length_error("persistent_arena_set: arena holds 2^32 nodes");
+    }
+    size_t bigger = std::min(std::max({n, 2 * capacity, min_capacity}), max_capacity);
+    node *fresh = std::allocator_traits<node_allocator>::allocate(alloc, bigger);
+    for (size_t i = 1; i < next; ++i) {
+        node &from = base[i];
+        node &to = fresh[i];
+        to.left = from.left;
+        to.right = from.right;
+        to.refs_height = from.refs_height;
+        if (from.refs()) {
+            new (&to.value) T(from.value);
+            from.value.~T();
+        }
+    }
+    if (base) {
+        std::allocator_traits<node_allocator>::deallocate(alloc, base, capacity);
+    }
+    base = fresh;
+    capacity = bigger;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index persistent_arena_set<T, Allocator, Compare>::arena::allocate() {
+    index result;
+    if (free_list) {
+        result = free_list;
+        free_list = at(result).left;
+        free_count--;
+    } else {
+        assert(next < capacity);
+        result = static_cast<index>(next++);
+    }
+    live++;
+    return result;
+}
+
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::arena::free(index i) {
+    assert(at(i).refs() == 0);
+    at(i).left = free_list;
+    free_list = i;
+    free_count++;
+    live--;
+}
+
+template<typename T, typename Allocator, typename Compare>
+persistent_arena_set<T, Allocator, Compare>::persistent_arena_set(arena &a, Compare const &comp)
+        : nodes(&a), root(0), _size(0), comp(comp) {}
+
+template<typename T, typename Allocator, typename Compare>
+persistent_arena_set<T, Allocator, Compare>::persistent_arena_set(persistent_arena_set const &other)
+        : nodes(other.nodes), root(other.share(other.root)), _size(other._size), comp(other.comp) {}
+
+template<typename T, typename Allocator, typename Compare>
+persistent_arena_set<T, Allocator, Compare>::persistent_arena_set(persistent_arena_set &&other) noexcept
+        : nodes(other.nodes), root(other.root), _size(other._size), comp(other.comp) {
+    other.root = 0;
+    other._size = 0;
+}
+
+template<typename T, typename Allocator, typename Compare>
+persistent_arena_set<T, Allocator, Compare> &persistent_arena_set<T, Allocator, Compare>::operator=(persistent_arena_set const &other) {
+    persistent_arena_set tmp(other);
+    swap(tmp);
+    return *this;
+}
+
+template<typename T, typename Allocator, typename Compare>
+persistent_arena_set<T, Allocator, Compare> &persistent_arena_set<T, Allocator, Compare>::operator=(persistent_arena_set &&other) noexcept {
+    persistent_arena_set tmp(std::move(other));
+    swap(tmp);
+    return *this;
+}
+
+template<typename T, typename Allocator, typename Compare>
+persistent_arena_set<T, Allocator, Compare>::~persistent_arena_set() {
+    release(root);
+}
+
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::clear() {
+    release(root);
+    root = 0;
+    _size = 0;
+}
+
+template<typename T, typename Allocator, typename Compare>
+bool persistent_arena_set<T, Allocator, Compare>::empty() const {
+    return _size == 0;
+}
+
+template<typename T, typename Allocator, typename Compare>
+size_t persistent_arena_set<T, Allocator, Compare>::size() const {
+    return _size;
+}
+
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::swap(persistent_arena_set &other) {
+    std::swap(nodes, other.nodes);
+    std::swap(root, other.root);
+    std::swap(_size, other._size);
+    std::swap(comp, other.comp);
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::arena &persistent_arena_set<T, Allocator, Compare>::get_arena() const {
+    return *nodes;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::key_compare persistent_arena_set<T, Allocator, Compare>::key_comp() const {
+    return comp;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::const_iterator persistent_arena_set<T, Allocator, Compare>::begin() const {
+    iterator result(nodes, root);
+    result.leftmost(root);
+    return result;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::const_iterator persistent_arena_set<T, Allocator, Compare>::end() const {
+    return iterator(nodes, root);
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::const_reverse_iterator persistent_arena_set<T, Allocator, Compare>::rbegin() const {
+    return const_reverse_iterator(end());
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::const_reverse_iterator persistent_arena_set<T, Allocator, Compare>::rend() const {
+    return const_reverse_iterator(begin());
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator persistent_arena_set<T, Allocator, Compare>::find(T const &value) const {
+    iterator result = lower_bound(value);
+    if (result != end() && comp(value, *result)) {
+        return end();
+    }
+    return result;
+}
+
+template<typename T, typename Allocator, typename Compare>
+size_t persistent_arena_set<T, Allocator, Compare>::count(T const &value) const {
+    return find(value) != end();
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator persistent_arena_set<T, Allocator, Compare>::lower_bound(T const &value) const {
+    return bound(value, false);
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator persistent_arena_set<T, Allocator, Compare>::upper_bound(T const &value) const {
+    return bound(value, true);
+}
+
+// First value not less than `value` (greater than it if `upper`), with its ancestors from
+// the descent: they are a prefix of the nodes visited.
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator persistent_arena_set<T, Allocator, Compare>::bound(T const &value, bool upper) const {
+    iterator result(nodes, root);
+    size_t found_depth = 0;
+    for (index cur = root; cur;) {
+        node &v = nodes->at(cur);
+        result.path[result.depth++] = cur;
+        if (upper ? comp(value, v.value) : !comp(v.value, value)) {
+            found_depth = result.depth;
+            cur = v.left;
+        } else {
+            cur = v.right;
+        }
+    }
+    result.depth = found_depth;
+    return result;
+}
+
+template<typename T, typename Allocator, typename Compare>
+std::pair<typename persistent_arena_set<T, Allocator, Compare>::iterator, bool>
+persistent_arena_set<T, Allocator, Compare>::insert(T const &value) {
+    if (nodes->holds(&value)) {
+        T copy(value);
+        return insert(copy);
+    }
+    // Every level copies at most the node on the path and two moved by a rotation.
+    nodes->reserve(3 * (max_height + 1));
+    bool inserted = false;
+    iterator at(nodes, 0);
+    index tree = insert_impl(root, value, inserted, at);
+    if (inserted) {
+        release(root);
+        root = tree;
+        _size++;
+    }
+    at.root = root;
+    std::reverse(at.path, at.path + at.depth);
+    return {at, inserted};
+}
+
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::erase(iterator const &it) {
+    erase(*it);
+}
+
+template<typename T, typename Allocator, typename Compare>
+size_t persistent_arena_set<T, Allocator, Compare>::erase(T const &value) {
+    if (nodes->holds(&value)) {
+        T copy(value);
+        return erase(copy);
+    }
+    nodes->reserve(3 * (max_height + 1));
+    bool erased = false;
+    index result = erase_impl(root, value, erased);
+    if (!erased) {
+        return 0;
+    }
+    release(root);
+    root = result;
+    _size--;
+    return 1;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index persistent_arena_set<T, Allocator, Compare>::share(index v) const {
+    if (v) {
+        assert(nodes->at(v).refs() < node::refs_mask);
+        nodes->at(v).refs_height++;
+    }
+    return v;
+}
+
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::release(index v) const {
+    if (!v) {
+        return;
+    }
+    node &n = nodes->at(v);
+    if (--n.refs_height & node::refs_mask) {
+        return;
+    }
+    release(n.left);
+    release(n.right);
+    n.value.~T();
+    nodes->free(v);
+}
+
+// A new node owning `left` and `right`; the room for it has been reserved.
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index
+persistent_arena_set<T, Allocator, Compare>::make_node(T const &value, index left, index right) const {
+    index result = nodes->allocate();
+    node &n = nodes->at(result);
+    n.left = left;
+    n.right = right;
+    n.refs_height = 1 | (std::max(height(left), height(right)) + 1) << node::refs_bits;
+    new (&n.value) T(value);
+    return result;
+}
+
+// The children of `v`, to which the caller holds a reference: moved out of it if the caller
+// holds the only one, shared otherwise.
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index persistent_arena_set<T, Allocator, Compare>::take_left(index v) const {
+    node &n = nodes->at(v);
+    if (n.refs() == 1) {
+        index result = n.left;
+        n.left = 0;
+        return result;
+    }
+    return share(n.left);
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index persistent_arena_set<T, Allocator, Compare>::take_right(index v) const {
+    node &n = nodes->at(v);
+    if (n.refs() == 1) {
+        index result = n.right;
+        n.right = 0;
+        return result;
+    }
+    return share(n.right);
+}
+
+// `self` (a reference the caller gives up) with new children: updated in place if that was
+// its only reference, copied otherwise. `track`, if given, follows the node insert() placed.
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index
+persistent_arena_set<T, Allocator, Compare>::rebuild(index self, index left, index right, iterator *track) const {
+    node &n = nodes->at(self);
+    index result = self;
+    if (n.refs() == 1) {
+        release(n.left);
+        release(n.right);
+        n.left = left;
+        n.right = right;
+        n.refs_height = 1 | (std::max(height(left), height(right)) + 1) << node::refs_bits;
+    } else {
+        result = make_node(n.value, left, right);
+        release(self);
+    }
+    if (track) {
+        track->follow(self, result);
+    }
+    return result;
+}
+
+// As persistent_set::balance: children at most two levels apart are fixed by a single or
+// double rotation.
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index
+persistent_arena_set<T, Allocator, Compare>::balance(index self, index left, index right, iterator *track) const {
+    if (height(left) > height(right) + 1) {
+        node &l = nodes->at(left);
+        if (height(l.left) >= height(l.right)) {
+            index outer = take_left(left);
+            index inner = take_right(left);
+            index lower = rebuild(self, inner, right, track);
+            return rebuild(left, outer, lower, track);
+        } else {
+            index outer = take_left(left);
+            index mid = take_right(left);
+            index mid_left = take_left(mid);
+            index mid_right = take_right(mid);
+            index lower_left = rebuild(left, outer, mid_left, track);
+            index lower_right = rebuild(self, mid_right, right, track);
+            return rebuild(mid, lower_left, lower_right, track);
+        }
+    } else if (height(right) > height(left) + 1) {
+        node &r = nodes->at(right);
+        if (height(r.right) >= height(r.left)) {
+            index outer = take_right(right);
+            index inner = take_left(right);
+            index lower = rebuild(self, left, inner, track);
+            return rebuild(right, lower, outer, track);
+        } else {
+            index outer = take_right(right);
+            index mid = take_left(right);
+            index mid_left = take_left(mid);
+            index mid_right = take_right(mid);
+            index lower_left = rebuild(self, left, mid_left, track);
+            index lower_right = rebuild(right, mid_right, outer, track);
+            return rebuild(mid, lower_left, lower_right, track);
+        }
+    }
+    return rebuild(self, left, right, track);
+}
+
+// The subtree at `pos` with `value` added, if it was not there. `at` gathers the node
+// holding `value` and its ancestors, bottom-up, as the descent unwinds. A new node is only
+// referenced by its parent, so rotations move it in place and its index holds.
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index
+persistent_arena_set<T, Allocator, Compare>::insert_impl(index pos, T const &value, bool &inserted, iterator &at) const {
+    if (!pos) {
+        inserted = true;
+        index result = make_node(value, 0, 0);
+        at.path[at.depth++] = result;
+        return result;
+    }
+    node &n = nodes->at(pos);
+    if (comp(value, n.value)) {
+        index left = insert_impl(n.left, value, inserted, at);
+        if (inserted)
+            return balance(share(pos), left, share(n.right), &at);
+    } else if (comp(n.value, value)) {
+        index right = insert_impl(n.right, value, inserted, at);
+        if (inserted)
+            return balance(share(pos), share(n.left), right, &at);
+    } else {
+        inserted = false;
+    }
+    at.path[at.depth++] = pos;
+    return 0;
+}
+
+// The subtree at `pos` without `value`, if it was there.
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index
+persistent_arena_set<T, Allocator, Compare>::erase_impl(index pos, T const &value, bool &erased) const {
+    if (!pos) {
+        erased = false;
+        return 0;
+    }
+    node &n = nodes->at(pos);
+    if (comp(value, n.value)) {
+        index left = erase_impl(n.left, value, erased);
+        return erased ? balance(share(pos), left, share(n.right)) : 0;
+    } else if (comp(n.value, value)) {
+        index right = erase_impl(n.right, value, erased);
+        return erased ? balance(share(pos), share(n.left), right) : 0;
+    }
+    erased = true;
+    if (!n.left) {
+        return share(n.right);
+    } else if (!n.right) {
+        return share(n.left);
+    }
+    index minimum;
+    index right = erase_min(n.right, minimum);
+    return balance(minimum, share(n.left), right);
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::index
+persistent_arena_set<T, Allocator, Compare>::erase_min(index pos, index &minimum) const {
+    node &n = nodes->at(pos);
+    if (!n.left) {
+        minimum = share(pos);
+        return share(n.right);
+    }
+    index left = erase_min(n.left, minimum);
+    return balance(share(pos), left, share(n.right));
+}
+
+template<typename T, typename Allocator, typename Compare>
+unsigned persistent_arena_set<T, Allocator, Compare>::height(index v) const {
+    return v ? nodes->at(v).height() : 0;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator::reference
+persistent_arena_set<T, Allocator, Compare>::iterator::operator*() const {
+    return nodes->at(path[depth - 1]).value;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator::pointer
+persistent_arena_set<T, Allocator, Compare>::iterator::operator->() const {
+    return &nodes->at(path[depth - 1]).value;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator &persistent_arena_set<T, Allocator, Compare>::iterator::operator++() {
+    index right = nodes->at(path[depth - 1]).right;
+    if (right) {
+        leftmost(right);
+        return *this;
+    }
+    index child;
+    do {
+        child = path[--depth];
+    } while (depth > 0 && nodes->at(path[depth - 1]).right == child);
+    return *this;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator persistent_arena_set<T, Allocator, Compare>::iterator::operator++(int) {
+    iterator result = *this;
+    ++*this;
+    return result;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator &persistent_arena_set<T, Allocator, Compare>::iterator::operator--() {
+    if (depth == 0) {
+        rightmost(root);
+        return *this;
+    }
+    index left = nodes->at(path[depth - 1]).left;
+    if (left) {
+        rightmost(left);
+        return *this;
+    }
+    index child;
+    do {
+        child = path[--depth];
+    } while (depth > 0 && nodes->at(path[depth - 1]).left == child);
+    return *this;
+}
+
+template<typename T, typename Allocator, typename Compare>
+typename persistent_arena_set<T, Allocator, Compare>::iterator persistent_arena_set<T, Allocator, Compare>::iterator::operator--(int) {
+    iterator result = *this;
+    --*this;
+    return result;
+}
+
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::iterator::leftmost(index v) {
+    for (; v; v = nodes->at(v).left) {
+        path[depth++] = v;
+    }
+}
+
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::iterator::rightmost(index v) {
+    for (; v; v = nodes->at(v).right) {
+        path[depth++] = v;
+    }
+}
+
+// Keeps the node insert() placed and its ancestors, bottom-up in path, up to date while
+// rebuild() turns `self` into `v`: v holds the placed node if a child of it is on the path,
+// and the entries above that child were moved by the rotation.
+template<typename T, typename Allocator, typename Compare>
+void persistent_arena_set<T, Allocator, Compare>::iterator::follow(index self, index v) {
+    if (self == path[0]) {
+        path[0] = v;
+        depth = 1;
+        return;
+    }
+    node &n = nodes->at(v);
+    for (size_t i = depth; i-- > 0;) {
+        if (path[i] == n.left || path[i] == n.right) {
+            depth = i + 1;
+            path[depth++] = v;
+            return;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,1210 @@
+#ifndef PERSISTENT_BTREE_SET_H
+#define PERSISTENT_BTREE_SET_H
+
+#include "persistent_set.h" // atomic_refcount, plain_refcount
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Levels of a B-tree with fewer than 2^64 keys whose inner nodes below the root have at
+// least `fanout` children.
+constexpr std::size_t btree_height_bound(std::size_t fanout) {
+    std::size_t height = 2;
+    for (std::size_t nodes = 2; nodes <= SIZE_MAX / fanout; nodes *= fanout) {
+        ++height;
+    }
+    return height;
+}
+
+// Search inside a node for arithmetic keys: the number of leading keys of a sorted array
+// that are less than `key` (not greater than it if `upper`). Keys are compared a vector at a
+// time (SSE2, or AVX2 when enabled at compile time) and the scan stops at the first vector
+// that is not entirely below `key`. Types without a vector path here are not `enabled` and
+// are searched by bisection.
+template<typename T>
+struct simd_node_search {
+#if defined(__SSE2__)
+    static constexpr bool enabled = (std::is_integral<T>::value && sizeof(T) == 4) ||
+                                    std::is_same<T, float>::value || std::is_same<T, double>::value
+#if defined(__AVX2__)
+                                    || (std::is_integral<T>::value && sizeof(T) == 8)
+#endif
+            ;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    static std::size_t rank(T const *keys, std::size_t n, T key, bool upper);
+};
+
+template<typename T>
+std::size_t simd_node_search<T>::rank(T const *keys, std::size_t n, T key, bool upper) {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    // `bits` has a bit set for each counted lane; keys are sorted, so they form a prefix.
+    if constexpr (std::is_integral<T>::value && sizeof(T) == 4) {
+        // Unsigned keys are compared as signed ones with the sign bit flipped.
+        std::int32_t const flip = std::is_signed<T>::value ? 0 : INT32_MIN;
+        std::int32_t const k = static_cast<std::int32_t>(key) ^ flip;
+#if defined(__AVX2__)
+        for (__m256i const bias = _mm256_set1_epi32(flip), k8 = _mm256_set1_epi32(k); i + 8 <= n; i += 8) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(keys + i)), bias);
+            int bits = _mm256_movemask_ps(_mm256_castsi256_ps(
+                    upper ? _mm256_cmpgt_epi32(v, k8) : _mm256_cmpgt_epi32(k8, v)));
+            bits = upper ? ~bits & 0xff : bits;
+            if (bits != 0xff)
+                return i + __builtin_popcount(bits);
+        }
+#endif
+        for (__m128i const bias = _mm_set1_epi32(flip), k4 = _mm_set1_epi32(k); i + 4 <= n; i += 4) {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const *>(keys + i)), bias);
+            int bits = _mm_movemask_ps(_mm_castsi128_ps(upper ? _mm_cmpgt_epi32(v, k4) : _mm_cmpgt_epi32(k4, v)));
+            bits = upper ? ~bits & 0xf : bits;
+            if (bits != 0xf)
+                return i + __builtin_popcount(bits);
+        }
+    } else if constexpr (std::is_integral<T>::value && sizeof(T) == 8) {
+#if defined(__AVX2__)
+        std::int64_t const flip = std::is_signed<T>::value ? 0 : INT64_MIN;
+        __m256i const bias = _mm256_set1_epi64x(flip);
+        __m256i const k4 = _mm256_set1_epi64x(static_cast<std::int64_t>(key) ^ flip);
+        for (; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(keys + i)), bias);
+            int bits = _mm256_movemask_pd(_mm256_castsi256_pd(
+                    upper ? _mm256_cmpgt_epi64(v, k4) : _mm256_cmpgt_epi64(k4, v)));
+            bits = upper ? ~bits & 0xf : bits;
+            if (bits != 0xf)
+                return i + __builtin_popcount(bits);
+        }
+#endif
+    } else if constexpr (std::is_same<T, float>::value) {
+#if defined(__AVX2__)
+        for (__m256 const k8 = _mm256_set1_ps(key); i + 8 <= n; i += 8) {
+            __m256 v = _mm256_loadu_ps(keys + i);
+            int bits = _mm256_movemask_ps(upper ? _mm256_cmp_ps(v, k8, _CMP_LE_OQ) : _mm256_cmp_ps(v, k8, _CMP_LT_OQ));
+            if (bits != 0xff)
+                return i + __builtin_popcount(bits);
+        }
+#endif
+        for (__m128 const k4 = _mm_set1_ps(key); i + 4 <= n; i += 4) {
+            __m128 v = _mm_loadu_ps(keys + i);
+            int bits = _mm_movemask_ps(upper ? _mm_cmple_ps(v, k4) : _mm_cmplt_ps(v, k4));
+            if (bits != 0xf)
+                return i + __builtin_popcount(bits);
+        }
+    } else if constexpr (std::is_same<T, double>::value) {
+#if defined(__AVX2__)
+        for (__m256d const k4 = _mm256_set1_pd(key); i + 4 <= n; i += 4) {
+            __m256d v = _mm256_loadu_pd(keys + i);
+            int bits = _mm256_movemask_pd(upper ? _mm256_cmp_pd(v, k4, _CMP_LE_OQ) : _mm256_cmp_pd(v, k4, _CMP_LT_OQ));
+            if (bits != 0xf)
+                return i + __builtin_popcount(bits);
+        }
+#endif
+        for (__m128d const k2 = _mm_set1_pd(key); i + 2 <= n; i += 2) {
+            __m128d v = _mm_loadu_pd(keys + i);
+            int bits = _mm_movemask_pd(upper ? _mm_cmple_pd(v, k2) : _mm_cmplt_pd(v, k2));
+            if (bits != 0x3)
+                return i + __builtin_popcount(bits);
+        }
+    }
+#endif
+    for (; i < n && (upper ? !(key < keys[i]) : keys[i] < key); ++i) {}
+    return i;
+}
+
+// Prefetches the cache lines of a node about to be searched.
+inline void prefetch_node(void const *p, std::size_t size) {
+#if defined(__GNUC__)
+    for (std::size_t offset = 0; offset < size; offset += 64) {
+        __builtin_prefetch(static_cast<char const *>(p) + offset);
+    }
+#else
+    (void) p;
+    (void) size;
+#endif
+}
+
+// Persistent B-tree: up to B keys stored inline per node, with path copying at node
+// granularity. A lookup visits about log_B(n) nodes instead of the log2(n) of persistent_set,
+// and there is one reference count per node rather than per element; an update copies the
+// same number of nodes of up to B keys. The interface follows persistent_set. The default B
+// gives 128 bytes of keys per node.
+template<typename T, std::size_t B = (128 / sizeof(T) > 4 ? 128 / sizeof(T) : 4),
+        typename RefCount = atomic_refcount, typename Allocator = std::allocator<T>, typename Compare = std::less<T>>
+struct persistent_btree_set {
+    static_assert(B >= 3, "a B-tree node needs room for at least 3 keys");
+
+    typedef T value_type;
+    typedef Allocator allocator_type;
+    typedef Compare key_compare;
+    typedef Compare value_compare;
+    struct node;
+    struct inner;
+
+    struct iterator;
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    // Every node but the root keeps at least this many keys.
+    static constexpr std::size_t min_keys = (B - 1) / 2;
+
+    static constexpr std::size_t max_height = btree_height_bound(min_keys + 1);
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    const_reverse_iterator rbegin() const;
+
+    const_reverse_iterator rend() const;
+
+
+    persistent_btree_set();
+
+    explicit persistent_btree_set(Allocator const &alloc);
+
+    explicit persistent_btree_set(Compare const &comp, Allocator const &alloc = Allocator());
+
+    persistent_btree_set(persistent_btree_set const &other);
+
+    persistent_btree_set &operator=(persistent_btree_set const &other);
+
+    ~persistent_btree_set();
+
+    void clear();
+
+    bool empty() const;
+
+    size_t size() const;
+
+    void swap(persistent_btree_set &other);
+
+    allocator_type get_allocator() const;
+
+    key_compare key_comp() const;
+
+    iterator find(T const &value) const;
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(K const &key) const;
+
+    size_t count(T const &value) const;
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t count(K const &key) const;
+
+    iterator lower_bound(T const &value) const;
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(K const &key) const;
+
+    iterator upper_bound(T const &value) const;
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(K const &key) const;
+
+    // Writes count(x) for every x in [first, last) to `out`. The keys go down the tree in
+    // groups, a level at a time, and the nodes each one needs next are prefetched, so the
+    // cache misses of a group overlap instead of following each other.
+    template<typename ForwardIt, typename OutputIt>
+    OutputIt count_batch(ForwardIt first, ForwardIt last, OutputIt out) const;
+
+    std::pair<iterator, bool> insert(T const &value);
+
+    void erase(iterator const &it);
+
+    size_t erase(T const &value);
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t erase(K const &key);
+
+    struct node {
+        typename RefCount::counter refs;
+        std::uint32_t count;
+        bool leaf;
+        alignas(T) unsigned char storage[B * sizeof(T)];
+
+        explicit node(bool leaf);
+
+        ~node();
+
+        T *keys();
+
+        T const *keys() const;
+
+        T const &key(size_t i) const;
+    };
+
+    struct inner : node {
+        node *children[B + 1];
+
+        inner();
+    };
+
+private:
+    struct node_ref;
+
+    // A rebuilt node, or the two halves and the middle key of one that overflowed.
+    struct insert_result;
+
+    // insert_impl records where the key it inserted or found ends up in `at`, from the
+    // bottom up: the frames of the nodes it builds, or of the ones it goes through.
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<node> leaf_allocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<inner> inner_allocator;
+
+    static node *child_of(node const *v, size_t i);
+
+    static constexpr bool natural_order = std::is_same<Compare, std::less<T>>::value ||
+                                          std::is_same<Compare, std::less<>>::value;
+
+    // Keys of type K are searched with simd_node_search inside nodes.
+    template<typename K>
+    static constexpr bool vector_search = natural_order && std::is_same<K, T>::value &&
+                                          simd_node_search<T>::enabled;
+
+    template<typename K>
+    size_t lower_index(node const *v, K const &key) const;
+
+    template<typename K>
+    size_t upper_index(node const *v, K const &key) const;
+
+    template<typename K>
+    iterator find_impl(K const &key) const;
+
+    template<typename K>
+    iterator bound(K const &key, bool upper) const;
+
+    template<typename K>
+    size_t erase_key(K const &key);
+
+    insert_result insert_impl(node *v, T const &value, iterator &at) const;
+
+    static void track(insert_result &r, iterator &at, size_t n, size_t pos, bool key);
+
+    template<typename KeyAt, typename ChildAt>
+    insert_result place(bool leaf, size_t n, KeyAt key, ChildAt child) const;
+
+    template<typename K>
+    node_ref erase_impl(node *v, K const &key) const;
+
+    node_ref erase_max(node *v, T const *&max) const;
+
+    node_ref fix_child(node *v, size_t i, node_ref c, T const *replace) const;
+
+    template<typename KeyAt, typename ChildAt>
+    node_ref build(bool leaf, size_t n, KeyAt key, ChildAt child) const;
+
+    void release(node *v) const;
+
+    static void assign_alloc(Allocator &to, Allocator const &from);
+
+    node *root;
+
+    size_t _size;
+
+    Allocator alloc;
+
+    Compare comp;
+};
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+struct persistent_btree_set<T, B, RefCount, Allocator, Compare>::node_ref {
+    node *p;
+    persistent_btree_set const *set;
+
+    node_ref() : p(nullptr), set(nullptr) {}
+
+    node_ref(node *p, persistent_btree_set const *set) : p(p), set(set) {}
+
+    node_ref(node_ref &&other) noexcept : p(other.p), set(other.set) {
+        other.p = nullptr;
+    }
+
+    node_ref &operator=(node_ref &&other) noexcept {
+        std::swap(p, other.p);
+        std::swap(set, other.set);
+        return *this;
+    }
+
+    ~node_ref() {
+        if (p)
+            set->release(p);
+    }
+
+    explicit operator bool() const {
+        return p != nullptr;
+    }
+
+    node *operator->() const {
+        return p;
+    }
+
+    node *take() {
+        node *result = p;
+        p = nullptr;
+        return result;
+    }
+};
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+struct persistent_btree_set<T, B, RefCount, Allocator, Compare>::insert_result {
+    enum part {
+        in_left, in_middle, in_right
+    };
+
+    node_ref left;
+    node_ref right;
+    T const *middle = nullptr;
+    // The part that holds the key being inserted.
+    part where = in_left;
+};
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+struct persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator {
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = T const;
+    using pointer = T const *;
+    using reference = T const &;
+
+    iterator() = default;
+
+    iterator(iterator const &other);
+
+    iterator &operator=(iterator const &other);
+
+    reference operator*() const;
+
+    pointer operator->() const;
+
+    iterator &operator++();
+
+    iterator operator++(int);
+
+    iterator &operator--();
+
+    iterator operator--(int);
+
+    friend bool operator==(iterator const &a, iterator const &b) {
+        if (a.depth != b.depth)
+            return false;
+        return a.depth == 0 || (a.path[a.depth - 1].v == b.path[b.depth - 1].v &&
+                                a.path[a.depth - 1].pos == b.path[b.depth - 1].pos);
+    }
+
+    friend bool operator!=(iterator const &a, iterator const &b) {
+        return !(a == b);
+    }
+
+private:
+    friend struct persistent_btree_set;
+
+    // A node on the way down, with the index of the key the iterator is at (the last
+    // frame) or of the child it went into (the frames above).
+    struct frame {
+        node *v;
+        size_t pos;
+    };
+
+    node *root;
+    frame path[max_height];
+    size_t depth;
+
+    explicit iterator(node *root) : root(root), depth(0) {}
+
+    void push(node *v, size_t pos);
+
+    void leftmost(node *v);
+
+    void rightmost(node *v);
+};
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::node::node(bool leaf) : refs(1), count(0), leaf(leaf) {}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::node::~node() {
+    for (size_t i = 0; i < count; ++i) {
+        keys()[i].~T();
+    }
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+T *persistent_btree_set<T, B, RefCount, Allocator, Compare>::node::keys() {
+    return std::launder(reinterpret_cast<T *>(storage));
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+T const *persistent_btree_set<T, B, RefCount, Allocator, Compare>::node::keys() const {
+    return std::launder(reinterpret_cast<T const *>(storage));
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+T const &persistent_btree_set<T, B, RefCount, Allocator, Compare>::node::key(size_t i) const {
+    return keys()[i];
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::inner::inner() : node(false) {
+    std::fill(children, children + B + 1, nullptr);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::persistent_btree_set() : alloc(), comp() {
+    root = nullptr;
+    _size = 0;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::persistent_btree_set(Allocator const &alloc)
+        : alloc(alloc), comp() {
+    root = nullptr;
+    _size = 0;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::persistent_btree_set(Compare const &comp,
+                                                                             Allocator const &alloc)
+        : alloc(alloc), comp(comp) {
+    root = nullptr;
+    _size = 0;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::persistent_btree_set(persistent_btree_set const &other)
+        : alloc(other.alloc), comp(other.comp) {
+    root = other.root;
+    _size = other._size;
+    if (root)
+        RefCount::acquire(root->refs);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare> &
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::operator=(persistent_btree_set const &other) {
+    persistent_btree_set tmp(other);
+    swap(tmp);
+    return *this;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::~persistent_btree_set() {
+    release(root);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::clear() {
+    release(root);
+    root = nullptr;
+    _size = 0;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+bool persistent_btree_set<T, B, RefCount, Allocator, Compare>::empty() const {
+    return _size == 0;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_btree_set<T, B, RefCount, Allocator, Compare>::size() const {
+    return _size;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::swap(persistent_btree_set &other) {
+    std::swap(root, other.root);
+    std::swap(_size, other._size);
+    std::swap(comp, other.comp);
+    Allocator tmp(alloc);
+    assign_alloc(alloc, other.alloc);
+    assign_alloc(other.alloc, tmp);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::assign_alloc(Allocator &to, Allocator const &from) {
+    if (&to != &from) {
+        to.~Allocator();
+        ::new(static_cast<void *>(&to)) Allocator(from);
+    }
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::allocator_type
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::get_allocator() const {
+    return alloc;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::key_compare
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::key_comp() const {
+    return comp;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::const_iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::begin() const {
+    iterator result(root);
+    if (root)
+        result.leftmost(root);
+    return result;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::const_iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::end() const {
+    return iterator(root);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::const_reverse_iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::rbegin() const {
+    return const_reverse_iterator(end());
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::const_reverse_iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::rend() const {
+    return const_reverse_iterator(begin());
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::node *
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::child_of(node const *v, size_t i) {
+    return static_cast<inner const *>(v)->children[i];
+}
+
+// Index of the first key of `v` not less than `key`.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+size_t persistent_btree_set<T, B, RefCount, Allocator, Compare>::lower_index(node const *v, K const &key) const {
+    if constexpr (vector_search<K>) {
+        return simd_node_search<T>::rank(v->keys(), v->count, key, false);
+    }
+    size_t lo = 0;
+    size_t hi = v->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (comp(v->key(mid), key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Index of the first key of `v` greater than `key`.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+size_t persistent_btree_set<T, B, RefCount, Allocator, Compare>::upper_index(node const *v, K const &key) const {
+    if constexpr (vector_search<K>) {
+        return simd_node_search<T>::rank(v->keys(), v->count, key, true);
+    }
+    size_t lo = 0;
+    size_t hi = v->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (comp(key, v->key(mid))) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::find(T const &value) const {
+    return find_impl(value);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::find(K const &key) const {
+    return find_impl(key);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_btree_set<T, B, RefCount, Allocator, Compare>::count(T const &value) const {
+    return find_impl(value) != end();
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+size_t persistent_btree_set<T, B, RefCount, Allocator, Compare>::count(K const &key) const {
+    return find_impl(key) != end();
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::lower_bound(T const &value) const {
+    return bound(value, false);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::lower_bound(K const &key) const {
+    return bound(key, false);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::upper_bound(T const &value) const {
+    return bound(value, true);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::upper_bound(K const &key) const {
+    return bound(key, true);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::find_impl(K const &key) const {
+    iterator result(root);
+    for (node *v = root; v; v = child_of(v, result.path[result.depth - 1].pos)) {
+        size_t i = lower_index(v, key);
+        result.push(v, i);
+        if (i < v->count && !comp(key, v->key(i))) {
+            return result;
+        }
+        if (v->leaf) {
+            break;
+        }
+    }
+    return end();
+}
+
+// First key not less than `key` (greater than it if `upper`). The descent ends in a leaf;
+// if the position found there is past its last key, the answer is the nearest ancestor key
+// to the right, as in operator++.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::bound(K const &key, bool upper) const {
+    iterator result(root);
+    for (node *v = root; v;) {
+        size_t i = upper ? upper_index(v, key) : lower_index(v, key);
+        result.push(v, i);
+        if (v->leaf) {
+            break;
+        }
+        v = child_of(v, i);
+    }
+    while (result.depth > 0 && result.path[result.depth - 1].pos == result.path[result.depth - 1].v->count) {
+        --result.depth;
+    }
+    return result;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename ForwardIt, typename OutputIt>
+OutputIt persistent_btree_set<T, B, RefCount, Allocator, Compare>::count_batch(ForwardIt first, ForwardIt last, OutputIt out) const {
+    constexpr size_t group = 16;
+    ForwardIt keys[group];
+    node *at[group];
+    bool found[group];
+    while (first != last) {
+        size_t n = 0;
+        for (; n < group && first != last; ++n, ++first) {
+            keys[n] = first;
+            at[n] = root;
+            found[n] = false;
+        }
+        // All leaves are on the same level, so the whole group reaches them together.
+        for (bool deeper = root != nullptr; deeper;) {
+            deeper = false;
+            for (size_t i = 0; i < n; ++i) {
+                node *v = at[i];
+                if (!v) {
+                    continue;
+                }
+                size_t j = lower_index(v, *keys[i]);
+                if (j < v->count && !comp(*keys[i], v->key(j))) {
+                    found[i] = true;
+                    at[i] = nullptr;
+                } else if (v->leaf) {
+                    at[i] = nullptr;
+                } else {
+                    at[i] = child_of(v, j);
+                    prefetch_node(at[i], sizeof(node));
+                    deeper = true;
+                }
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            *out++ = found[i] ? 1 : 0;
+        }
+    }
+    return out;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+std::pair<typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator, bool>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::insert(T const &value) {
+    iterator at(nullptr);
+    node *new_root;
+    if (!root) {
+        new_root = build(true, 1, [&](size_t) -> T const & { return value; }, [](size_t) -> node * {
+            return nullptr;
+        }).take();
+        at.push(new_root, 0);
+    } else {
+        insert_result r = insert_impl(root, value, at);
+        if (!r.left) {
+            std::reverse(at.path, at.path + at.depth);
+            at.root = root;
+            return {at, false};
+        }
+        if (r.right) {
+            node *left = r.left.p;
+            node *right = r.right.p;
+            new_root = build(false, 1, [&](size_t) -> T const & { return *r.middle; }, [&](size_t j) {
+                return j == 0 ? left : right;
+            }).take();
+            at.push(new_root, r.where == insert_result::in_right ? 1 : 0);
+        } else {
+            new_root = r.left.take();
+        }
+    }
+    release(root);
+    root = new_root;
+    _size++;
+    std::reverse(at.path, at.path + at.depth);
+    at.root = root;
+    return {at, true};
+}
+
+// Inserts into the subtree of `v`; the result is empty if `value` is already there.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::insert_result
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::insert_impl(node *v, T const &value, iterator &at) const {
+    size_t i = lower_index(v, value);
+    if (i < v->count && !comp(value, v->key(i))) {
+        at.push(v, i);
+        return insert_result();
+    }
+    if (v->leaf) {
+        insert_result result = place(true, v->count + 1, [&](size_t j) -> T const & {
+            return j < i ? v->key(j) : j == i ? value : v->key(j - 1);
+        }, [](size_t) -> node * {
+            return nullptr;
+        });
+        track(result, at, v->count + 1, i, true);
+        return result;
+    }
+
+    insert_result sub = insert_impl(child_of(v, i), value, at);
+    if (!sub.left) {
+        at.push(v, i);
+        return sub;
+    }
+    node *left = sub.left.p;
+    if (!sub.right) {
+        insert_result result = place(false, v->count, [&](size_t j) -> T const & {
+            return v->key(j);
+        }, [&](size_t j) {
+            return j == i ? left : child_of(v, j);
+        });
+        track(result, at, v->count, i, false);
+        return result;
+    }
+    node *right = sub.right.p;
+    insert_result result = place(false, v->count + 1, [&](size_t j) -> T const & {
+        return j < i ? v->key(j) : j == i ? *sub.middle : v->key(j - 1);
+    }, [&](size_t j) {
+        return j < i ? child_of(v, j) : j == i ? left : j == i + 1 ? right : child_of(v, j - 1);
+    });
+    if (sub.where == insert_result::in_middle) {
+        track(result, at, v->count + 1, i, true);
+    } else {
+        track(result, at, v->count + 1, sub.where == insert_result::in_right ? i + 1 : i, false);
+    }
+    return result;
+}
+
+// Records that the key being inserted is key `pos` (or under child `pos`, unless `key`) of
+// the node of n keys that place() built, or of the half of it that holds it after a split.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::track(insert_result &r, iterator &at, size_t n,
+                                                                     size_t pos, bool key) {
+    if (n <= B) {
+        at.push(r.left.p, pos);
+        return;
+    }
+    size_t m = n / 2;
+    if (key && pos == m) {
+        r.where = insert_result::in_middle;
+    } else if (pos > m) {
+        r.where = insert_result::in_right;
+        at.push(r.right.p, pos - m - 1);
+    } else {
+        r.where = insert_result::in_left;
+        at.push(r.left.p, pos);
+    }
+}
+
+// A node with keys key(0..n) and children child(0..n], split around its middle key if
+// there are more than B keys.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename KeyAt, typename ChildAt>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::insert_result
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::place(bool leaf, size_t n, KeyAt key, ChildAt child) const {
+    insert_result result;
+    if (n <= B) {
+        result.left = build(leaf, n, key, child);
+        return result;
+    }
+    size_t m = n / 2;
+    result.left = build(leaf, m, key, child);
+    result.right = build(leaf, n - m - 1, [&](size_t j) -> T const & {
+        return key(j + m + 1);
+    }, [&](size_t j) {
+        return child(j + m + 1);
+    });
+    result.middle = &key(m);
+    return result;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::erase(iterator const &it) {
+    erase_key(*it);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_btree_set<T, B, RefCount, Allocator, Compare>::erase(T const &value) {
+    return erase_key(value);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+size_t persistent_btree_set<T, B, RefCount, Allocator, Compare>::erase(K const &key) {
+    return erase_key(key);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+size_t persistent_btree_set<T, B, RefCount, Allocator, Compare>::erase_key(K const &key) {
+    if (!root) {
+        return 0;
+    }
+    node_ref r = erase_impl(root, key);
+    if (!r) {
+        return 0;
+    }
+    node *new_root;
+    if (r->count != 0) {
+        new_root = r.take();
+    } else if (r->leaf) {
+        new_root = nullptr;
+    } else {
+        new_root = child_of(r.p, 0);
+        RefCount::acquire(new_root->refs);
+    }
+    release(root);
+    root = new_root;
+    _size--;
+    return 1;
+}
+
+// The subtree of `v` without `key`, possibly one key short of min_keys; empty if `key`
+// is not there. A key erased from an inner node is replaced by its predecessor.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::node_ref
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::erase_impl(node *v, K const &key) const {
+    size_t i = lower_index(v, key);
+    bool found = i < v->count && !comp(key, v->key(i));
+    if (v->leaf) {
+        if (!found) {
+            return node_ref();
+        }
+        return build(true, v->count - 1, [&](size_t j) -> T const & {
+            return v->key(j < i ? j : j + 1);
+        }, [](size_t) -> node * {
+            return nullptr;
+        });
+    }
+    if (found) {
+        T const *max;
+        node_ref c = erase_max(child_of(v, i), max);
+        return fix_child(v, i, std::move(c), max);
+    }
+    node_ref c = erase_impl(child_of(v, i), key);
+    if (!c) {
+        return c;
+    }
+    return fix_child(v, i, std::move(c), nullptr);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::node_ref
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::erase_max(node *v, T const *&max) const {
+    if (v->leaf) {
+        max = &v->key(v->count - 1);
+        return build(true, v->count - 1, [&](size_t j) -> T const & {
+            return v->key(j);
+        }, [](size_t) -> node * {
+            return nullptr;
+        });
+    }
+    node_ref c = erase_max(child_of(v, v->count), max);
+    return fix_child(v, v->count, std::move(c), nullptr);
+}
+
+// Copy of inner node `v` with child i replaced by `c` (and key i by *replace, if given).
+// If `c` is short of keys, it takes one from a sibling through the parent, or is merged
+// with a sibling and the key between them, which leaves the copy of `v` one key shorter.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::node_ref
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::fix_child(node *v, size_t i, node_ref c,
+                                                                   T const *replace) const {
+    auto key = [&](size_t j) -> T const & {
+        return replace && j == i ? *replace : v->key(j);
+    };
+    node *w = c.p;
+    size_t n = v->count;
+    if (w->count >= min_keys) {
+        return build(false, n, key, [&](size_t j) {
+            return j == i ? w : child_of(v, j);
+        });
+    }
+
+    if (i > 0) {
+        node *s = child_of(v, i - 1);
+        if (s->count > min_keys) {
+            node_ref left = build(s->leaf, s->count - 1, [&](size_t j) -> T const & {
+                return s->key(j);
+            }, [&](size_t j) {
+                return child_of(s, j);
+            });
+            node_ref right = build(w->leaf, w->count + 1, [&](size_t j) -> T const & {
+                return j == 0 ? key(i - 1) : w->key(j - 1);
+            }, [&](size_t j) {
+                return j == 0 ? child_of(s, s->count) : child_of(w, j - 1);
+            });
+            return build(false, n, [&](size_t j) -> T const & {
+                return j == i - 1 ? s->key(s->count - 1) : key(j);
+            }, [&](size_t j) {
+                return j == i - 1 ? left.p : j == i ? right.p : child_of(v, j);
+            });
+        }
+        node_ref merged = build(w->leaf, s->count + 1 + w->count, [&](size_t j) -> T const & {
+            return j < s->count ? s->key(j) : j == s->count ? key(i - 1) : w->key(j - s->count - 1);
+        }, [&](size_t j) {
+            return j <= s->count ? child_of(s, j) : child_of(w, j - s->count - 1);
+        });
+        return build(false, n - 1, [&](size_t j) -> T const & {
+            return key(j < i - 1 ? j : j + 1);
+        }, [&](size_t j) {
+            return j < i - 1 ? child_of(v, j) : j == i - 1 ? merged.p : child_of(v, j + 1);
+        });
+    }
+
+    node *s = child_of(v, i + 1);
+    if (s->count > min_keys) {
+        node_ref left = build(w->leaf, w->count + 1, [&](size_t j) -> T const & {
+            return j < w->count ? w->key(j) : key(i);
+        }, [&](size_t j) {
+            return j <= w->count ? child_of(w, j) : child_of(s, 0);
+        });
+        node_ref right = build(s->leaf, s->count - 1, [&](size_t j) -> T const & {
+            return s->key(j + 1);
+        }, [&](size_t j) {
+            return child_of(s, j + 1);
+        });
+        return build(false, n, [&](size_t j) -> T const & {
+            return j == i ? s->key(0) : key(j);
+        }, [&](size_t j) {
+            return j == i ? left.p : j == i + 1 ? right.p : child_of(v, j);
+        });
+    }
+    node_ref merged = build(w->leaf, w->count + 1 + s->count, [&](size_t j) -> T const & {
+        return j < w->count ? w->key(j) : j == w->count ? key(i) : s->key(j - w->count - 1);
+    }, [&](size_t j) {
+        return j <= w->count ? child_of(w, j) : child_of(s, j - w->count - 1);
+    });
+    return build(false, n - 1, [&](size_t j) -> T const & {
+        return key(j < i ? j : j + 1);
+    }, [&](size_t j) {
+        return j < i ? child_of(v, j) : j == i ? merged.p : child_of(v, j + 1);
+    });
+}
+
+// A new node with copies of key(0..n) and, for an inner node, references to child(0..n].
+// If copying a key throws, the partly built node is released.
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+template<typename KeyAt, typename ChildAt>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::node_ref
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::build(bool leaf, size_t n, KeyAt key, ChildAt child) const {
+    node *v;
+    if (leaf) {
+        leaf_allocator a(alloc);
+        v = std::allocator_traits<leaf_allocator>::allocate(a, 1);
+        std::allocator_traits<leaf_allocator>::construct(a, v, true);
+    } else {
+        inner_allocator a(alloc);
+        inner *w = std::allocator_traits<inner_allocator>::allocate(a, 1);
+        std::allocator_traits<inner_allocator>::construct(a, w);
+        for (size_t j = 0; j <= n; ++j) {
+            w->children[j] = child(j);
+            RefCount::acquire(w->children[j]->refs);
+        }
+        v = w;
+    }
+    node_ref result(v, this);
+    for (size_t j = 0; j < n; ++j) {
+        ::new(static_cast<void *>(v->keys() + j)) T(key(j));
+        ++v->count;
+    }
+    return result;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::release(node *v) const {
+    if (!v || !RefCount::release(v->refs)) {
+        return;
+    }
+    if (v->leaf) {
+        leaf_allocator a(alloc);
+        std::allocator_traits<leaf_allocator>::destroy(a, v);
+        std::allocator_traits<leaf_allocator>::deallocate(a, v, 1);
+    } else {
+        inner *w = static_cast<inner *>(v);
+        for (node *c : w->children) {
+            release(c);
+        }
+        inner_allocator a(alloc);
+        std::allocator_traits<inner_allocator>::destroy(a, w);
+        std::allocator_traits<inner_allocator>::deallocate(a, w, 1);
+    }
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void swap(persistent_btree_set<T, B, RefCount, Allocator, Compare> &a,
+          persistent_btree_set<T, B, RefCount, Allocator, Compare> &b) {
+    a.swap(b);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::iterator(iterator const &other)
+        : root(other.root), depth(other.depth) {
+    std::copy(other.path, other.path + depth, path);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator &
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::operator=(iterator const &other) {
+    root = other.root;
+    depth = other.depth;
+    std::copy(other.path, other.path + depth, path);
+    return *this;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::reference
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::operator*() const {
+    return path[depth - 1].v->key(path[depth - 1].pos);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::pointer
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::operator->() const {
+    return &**this;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator &
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::operator++() {
+    frame &top = path[depth - 1];
+    if (!top.v->leaf) {
+        ++top.pos;
+        leftmost(child_of(top.v, top.pos));
+        return *this;
+    }
+    if (++top.pos < top.v->count) {
+        return *this;
+    }
+    --depth;
+    while (depth > 0 && path[depth - 1].pos == path[depth - 1].v->count) {
+        --depth;
+    }
+    return *this;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::operator++(int) {
+    iterator copy = *this;
+    ++*this;
+    return copy;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator &
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::operator--() {
+    if (depth == 0) {
+        rightmost(root);
+        return *this;
+    }
+    frame &top = path[depth - 1];
+    if (!top.v->leaf) {
+        rightmost(child_of(top.v, top.pos));
+        return *this;
+    }
+    if (top.pos > 0) {
+        --top.pos;
+        return *this;
+    }
+    --depth;
+    while (depth > 0 && path[depth - 1].pos == 0) {
+        --depth;
+    }
+    if (depth > 0) {
+        --path[depth - 1].pos;
+    }
+    return *this;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+typename persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator
+persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::operator--(int) {
+    iterator copy = *this;
+    --*this;
+    return copy;
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::push(node *v, size_t pos) {
+    assert(depth < max_height);
+    path[depth++] = {v, pos};
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::leftmost(node *v) {
+    while (!v->leaf) {
+        push(v, 0);
+        v = child_of(v, 0);
+    }
+    push(v, 0);
+}
+
+template<typename T, std::size_t B, typename RefCount, typename Allocator, typename Compare>
+void persistent_btree_set<T, B, RefCount, Allocator, Compare>::iterator::rightmost(node *v) {
+    while (!v->leaf) {
+        push(v, v->count);
+        v = child_of(v, v->count);
+    }
+    push(v, v->count - 1);
+}
+
+#endif
@@ -0,0 +1,764 @@
+#ifndef PERSISTENT_HASH_SET_H
+#define PERSISTENT_HASH_SET_H
+
+#include "persistent_set.h" // atomic_refcount, plain_refcount
+
+#include <limits>
+
+// Persistent hash array mapped trie. Each level takes 5 bits of the hash and a node stores,
+// in one allocation, a bitmap of the slots holding a value, a bitmap of the slots holding a
+// child, and only the occupied slots, found by popcount. Values with equal full hashes share
+// a collision node at the bottom. Updates copy the path to the changed slot, and copying a
+// set is O(1), as for persistent_set; lookups take a hash and an expected O(1) node visits.
+// Iteration order is unspecified.
+template<typename T, typename Hash = std::hash<T>, typename Eq = std::equal_to<T>,
+        typename RefCount = atomic_refcount, typename Allocator = std::allocator<T>>
+struct persistent_hash_set {
+    typedef T value_type;
+    typedef Allocator allocator_type;
+    typedef Hash hasher;
+    typedef Eq key_equal;
+    struct node;
+
+    struct iterator;
+    using const_iterator = iterator;
+
+    static constexpr unsigned bits = 5;
+    static constexpr unsigned hash_bits = std::numeric_limits<std::size_t>::digits;
+    // Levels of branch nodes, plus one of collision nodes.
+    static constexpr std::size_t max_depth = (hash_bits + bits - 1) / bits + 1;
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+
+    persistent_hash_set();
+
+    explicit persistent_hash_set(Allocator const &alloc);
+
+    explicit persistent_hash_set(Hash const &hash, Eq const &eq = Eq(), Allocator const &alloc = Allocator());
+
+    persistent_hash_set(persistent_hash_set const &other);
+
+    persistent_hash_set &operator=(persistent_hash_set const &other);
+
+    ~persistent_hash_set();
+
+    void clear();
+
+    bool empty() const;
+
+    size_t size() const;
+
+    void swap(persistent_hash_set &other);
+
+    allocator_type get_allocator() const;
+
+    hasher hash_function() const;
+
+    key_equal key_eq() const;
+
+    iterator find(T const &value) const;
+
+    size_t count(T const &value) const;
+
+    std::pair<iterator, bool> insert(T const &value);
+
+    void erase(iterator const &it);
+
+    size_t erase(T const &value);
+
+    // A branch node has a bit in `datamap` for every slot holding a value and one in `nodemap`
+    // for every slot holding a child; a collision node keeps its number of values in `datamap`.
+    // The values, then the children, follow the header in the same block.
+    struct node {
+        typename RefCount::counter refs;
+        std::uint32_t datamap;
+        std::uint32_t nodemap;
+        bool collision;
+
+        node(bool collision, std::uint32_t datamap, std::uint32_t nodemap);
+
+        size_t values() const;
+
+        size_t children() const;
+
+        T const &value(size_t i) const;
+
+        node *child(size_t i) const;
+    };
+
+private:
+    static constexpr size_t unit_align = std::max({alignof(node), alignof(T), alignof(node *)});
+
+    // Allocation unit of nodes, aligned for the header, the values and the child pointers.
+    struct alignas(unit_align) unit {
+        unsigned char bytes[unit_align];
+    };
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<unit> unit_allocator;
+
+    static constexpr size_t values_offset = (sizeof(node) + alignof(T) - 1) / alignof(T) * alignof(T);
+
+    static size_t children_offset(size_t values);
+
+    static size_t units(size_t values, size_t children);
+
+    static unsigned popcount(std::uint32_t x);
+
+    static std::uint32_t slot(size_t hash, unsigned shift);
+
+    // Index among the set bits of `map` of the ones below `bit`.
+    static size_t index(std::uint32_t map, std::uint32_t bit);
+
+    template<typename ValueAt, typename ChildAt>
+    node *make_node(bool collision, std::uint32_t datamap, std::uint32_t nodemap, ValueAt value,
+                    ChildAt child) const;
+
+    // merge and insert_impl record where the value they insert or find ends up in `at`, from
+    // the bottom up: the frames of the nodes they build, or of the ones they go through.
+    node *merge(T const &a, size_t ha, T const &b, size_t hb, unsigned shift, iterator &at) const;
+
+    node *insert_impl(node *v, T const &value, size_t hash, unsigned shift, iterator &at) const;
+
+    node *erase_impl(node *v, T const &value, size_t hash, unsigned shift, bool &found) const;
+
+    void release(node *v) const;
+
+    static void assign_alloc(Allocator &to, Allocator const &from);
+
+    node *root;
+
+    size_t _size;
+
+    Allocator alloc;
+
+    Hash hash;
+
+    Eq eq;
+};
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+struct persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator {
+    using iterator_category = std::forward_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = T const;
+    using pointer = T const *;
+    using reference = T const &;
+
+    iterator() = default;
+
+    iterator(iterator const &other);
+
+    iterator &operator=(iterator const &other);
+
+    reference operator*() const;
+
+    pointer operator->() const;
+
+    iterator &operator++();
+
+    iterator operator++(int);
+
+    friend bool operator==(iterator const &a, iterator const &b) {
+        if (a.depth != b.depth)
+            return false;
+        return a.depth == 0 || (a.path[a.depth - 1].v == b.path[b.depth - 1].v &&
+                                a.path[a.depth - 1].pos == b.path[b.depth - 1].pos);
+    }
+
+    friend bool operator!=(iterator const &a, iterator const &b) {
+        return !(a == b);
+    }
+
+private:
+    friend struct persistent_hash_set;
+
+    // A node on the way down: the last frame is at value `pos`, the ones above are in
+    // child `pos - values()`.
+    struct frame {
+        node *v;
+        size_t pos;
+    };
+
+    frame path[max_depth];
+    size_t depth;
+
+    explicit iterator(node *root);
+
+    void settle();
+};
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node::node(bool collision, std::uint32_t datamap,
+                                                                 std::uint32_t nodemap)
+        : refs(1), datamap(datamap), nodemap(nodemap), collision(collision) {}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+size_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node::values() const {
+    return collision ? datamap : popcount(datamap);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+size_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node::children() const {
+    return collision ? 0 : popcount(nodemap);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+T const &persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node::value(size_t i) const {
+    return std::launder(reinterpret_cast<T const *>(reinterpret_cast<char const *>(this) + values_offset))[i];
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node *
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node::child(size_t i) const {
+    return reinterpret_cast<node *const *>(reinterpret_cast<char const *>(this) + children_offset(values()))[i];
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+size_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::children_offset(size_t values) {
+    size_t end = values_offset + values * sizeof(T);
+    return (end + alignof(node *) - 1) / alignof(node *) * alignof(node *);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+size_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::units(size_t values, size_t children) {
+    return (children_offset(values) + children * sizeof(node *) + sizeof(unit) - 1) / sizeof(unit);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+unsigned persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::popcount(std::uint32_t x) {
+#if defined(__GNUC__)
+    return static_cast<unsigned>(__builtin_popcount(x));
+#else
+    x = x - ((x >> 1) & 0x55555555u);
+    x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+    return static_cast<unsigned>((((x + (x >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24);
+#endif
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+std::uint32_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::slot(size_t hash, unsigned shift) {
+    return std::uint32_t(1) << ((hash >> shift) & ((1u << bits) - 1));
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+size_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::index(std::uint32_t map, std::uint32_t bit) {
+    return popcount(map & (bit - 1));
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::persistent_hash_set() : alloc(), hash(), eq() {
+    root = nullptr;
+    _size = 0;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::persistent_hash_set(Allocator const &alloc)
+        : alloc(alloc), hash(), eq() {
+    root = nullptr;
+    _size = 0;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::persistent_hash_set(Hash const &hash, Eq const &eq,
+                                                                          Allocator const &alloc)
+        : alloc(alloc), hash(hash), eq(eq) {
+    root = nullptr;
+    _size = 0;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::persistent_hash_set(persistent_hash_set const &other)
+        : alloc(other.alloc), hash(other.hash), eq(other.eq) {
+    root = other.root;
+    _size = other._size;
+    if (root)
+        RefCount::acquire(root->refs);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator> &
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::operator=(persistent_hash_set const &other) {
+    persistent_hash_set tmp(other);
+    swap(tmp);
+    return *this;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::~persistent_hash_set() {
+    release(root);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+void persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::clear() {
+    release(root);
+    root = nullptr;
+    _size = 0;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+bool persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::empty() const {
+    return _size == 0;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+size_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::size() const {
+    return _size;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+void persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::swap(persistent_hash_set &other) {
+    std::swap(root, other.root);
+    std::swap(_size, other._size);
+    std::swap(hash, other.hash);
+    std::swap(eq, other.eq);
+    Allocator tmp(alloc);
+    assign_alloc(alloc, other.alloc);
+    assign_alloc(other.alloc, tmp);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+void persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::assign_alloc(Allocator &to, Allocator const &from) {
+    if (&to != &from) {
+        to.~Allocator();
+        ::new(static_cast<void *>(&to)) Allocator(from);
+    }
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::allocator_type
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::get_allocator() const {
+    return alloc;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::hasher
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::hash_function() const {
+    return hash;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::key_equal
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::key_eq() const {
+    return eq;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::const_iterator
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::begin() const {
+    return iterator(root);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::const_iterator
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::end() const {
+    return iterator(nullptr);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::find(T const &value) const {
+    iterator result(nullptr);
+    size_t h = hash(value);
+    unsigned shift = 0;
+    for (node *v = root; v; shift += bits) {
+        if (v->collision) {
+            for (size_t i = 0; i < v->datamap; ++i) {
+                if (eq(v->value(i), value)) {
+                    result.path[result.depth++] = {v, i};
+                    return result;
+                }
+            }
+            break;
+        }
+        std::uint32_t bit = slot(h, shift);
+        if (v->datamap & bit) {
+            size_t i = index(v->datamap, bit);
+            if (!eq(v->value(i), value)) {
+                break;
+            }
+            result.path[result.depth++] = {v, i};
+            return result;
+        }
+        if (!(v->nodemap & bit)) {
+            break;
+        }
+        size_t i = index(v->nodemap, bit);
+        result.path[result.depth++] = {v, v->values() + i};
+        v = v->child(i);
+    }
+    return end();
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+size_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::count(T const &value) const {
+    return find(value) != end();
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+std::pair<typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator, bool>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::insert(T const &value) {
+    size_t h = hash(value);
+    iterator at(nullptr);
+    node *new_root;
+    if (!root) {
+        new_root = make_node(false, slot(h, 0), 0, [&](size_t) -> T const & { return value; },
+                             [](size_t) -> node * { return nullptr; });
+        at.path[at.depth++] = {new_root, 0};
+    } else {
+        new_root = insert_impl(root, value, h, 0, at);
+        std::reverse(at.path, at.path + at.depth);
+        if (!new_root) {
+            return {at, false};
+        }
+    }
+    release(root);
+    root = new_root;
+    _size++;
+    return {at, true};
+}
+
+// Copy of `v` with `value` added, or null if it is there already.
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node *
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::insert_impl(node *v, T const &value, size_t h,
+                                                                  unsigned shift, iterator &at) const {
+    auto no_child = [](size_t) -> node * {
+        return nullptr;
+    };
+    if (v->collision) {
+        size_t n = v->datamap;
+        for (size_t i = 0; i < n; ++i) {
+            if (eq(v->value(i), value)) {
+                at.path[at.depth++] = {v, i};
+                return nullptr;
+            }
+        }
+        node *result = make_node(true, static_cast<std::uint32_t>(n + 1), 0, [&](size_t i) -> T const & {
+            return i < n ? v->value(i) : value;
+        }, no_child);
+        at.path[at.depth++] = {result, n};
+        return result;
+    }
+
+    std::uint32_t bit = slot(h, shift);
+    if (v->datamap & bit) {
+        // The slot holds a value: both go one level down.
+        size_t i = index(v->datamap, bit);
+        T const &other = v->value(i);
+        if (eq(other, value)) {
+            at.path[at.depth++] = {v, i};
+            return nullptr;
+        }
+        node *sub = merge(other, hash(other), value, h, shift + bits, at);
+        size_t j = index(v->nodemap, bit);
+        try {
+            node *result = make_node(false, v->datamap ^ bit, v->nodemap | bit, [&](size_t k) -> T const & {
+                return v->value(k < i ? k : k + 1);
+            }, [&](size_t k) {
+                return k < j ? v->child(k) : k == j ? sub : v->child(k - 1);
+            });
+            release(sub);
+            at.path[at.depth++] = {result, result->values() + j};
+            return result;
+        } catch (...) {
+            release(sub);
+            throw;
+        }
+    }
+    if (v->nodemap & bit) {
+        size_t j = index(v->nodemap, bit);
+        node *sub = insert_impl(v->child(j), value, h, shift + bits, at);
+        if (!sub) {
+            at.path[at.depth++] = {v, v->values() + j};
+            return nullptr;
+        }
+        try {
+            node *result = make_node(false, v->datamap, v->nodemap, [&](size_t k) -> T const & {
+                return v->value(k);
+            }, [&](size_t k) {
+                return k == j ? sub : v->child(k);
+            });
+            release(sub);
+            at.path[at.depth++] = {result, result->values() + j};
+            return result;
+        } catch (...) {
+            release(sub);
+            throw;
+        }
+    }
+    size_t i = index(v->datamap, bit);
+    node *result = make_node(false, v->datamap | bit, v->nodemap, [&](size_t k) -> T const & {
+        return k < i ? v->value(k) : k == i ? value : v->value(k - 1);
+    }, [&](size_t k) {
+        return v->child(k);
+    });
+    at.path[at.depth++] = {result, i};
+    return result;
+}
+
+// A node at level `shift` holding `a` and `b`, whose hashes are `ha` and `hb`; `at` follows `b`.
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node *
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::merge(T const &a, size_t ha, T const &b, size_t hb,
+                                                            unsigned shift, iterator &at) const {
+    auto no_child = [](size_t) -> node * {
+        return nullptr;
+    };
+    node *result;
+    if (shift >= hash_bits) {
+        result = make_node(true, 2, 0, [&](size_t i) -> T const & {
+            return i == 0 ? a : b;
+        }, no_child);
+        at.path[at.depth++] = {result, 1};
+        return result;
+    }
+    std::uint32_t bit_a = slot(ha, shift);
+    std::uint32_t bit_b = slot(hb, shift);
+    if (bit_a != bit_b) {
+        result = make_node(false, bit_a | bit_b, 0, [&](size_t i) -> T const & {
+            return (i == 0) == (bit_a < bit_b) ? a : b;
+        }, no_child);
+        at.path[at.depth++] = {result, bit_a < bit_b ? 1u : 0u};
+        return result;
+    }
+    node *sub = merge(a, ha, b, hb, shift + bits, at);
+    try {
+        result = make_node(false, 0, bit_a, [&](size_t) -> T const & {
+            return a;
+        }, [&](size_t) {
+            return sub;
+        });
+        release(sub);
+        at.path[at.depth++] = {result, 0};
+        return result;
+    } catch (...) {
+        release(sub);
+        throw;
+    }
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+void persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::erase(iterator const &it) {
+    erase(*it);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+size_t persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::erase(T const &value) {
+    if (!root) {
+        return 0;
+    }
+    bool found = false;
+    node *new_root = erase_impl(root, value, hash(value), 0, found);
+    if (!found) {
+        return 0;
+    }
+    release(root);
+    root = new_root;
+    _size--;
+    return 1;
+}
+
+// Copy of `v` without `value` (null if nothing is left). A child left with a single value
+// and no children of its own is replaced by that value, so every branch node below the root
+// holds at least two values or a child.
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node *
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::erase_impl(node *v, T const &value, size_t h,
+                                                                 unsigned shift, bool &found) const {
+    auto no_child = [](size_t) -> node * {
+        return nullptr;
+    };
+    if (v->collision) {
+        size_t n = v->datamap;
+        for (size_t i = 0; i < n; ++i) {
+            if (eq(v->value(i), value)) {
+                found = true;
+                return make_node(true, static_cast<std::uint32_t>(n - 1), 0, [&](size_t k) -> T const & {
+                    return v->value(k < i ? k : k + 1);
+                }, no_child);
+            }
+        }
+        return nullptr;
+    }
+
+    std::uint32_t bit = slot(h, shift);
+    if (v->datamap & bit) {
+        size_t i = index(v->datamap, bit);
+        if (!eq(v->value(i), value))
+            return nullptr;
+        found = true;
+        if (v->values() == 1 && v->nodemap == 0)
+            return nullptr;
+        return make_node(false, v->datamap ^ bit, v->nodemap, [&](size_t k) -> T const & {
+            return v->value(k < i ? k : k + 1);
+        }, [&](size_t k) {
+            return v->child(k);
+        });
+    }
+    if (!(v->nodemap & bit)) {
+        return nullptr;
+    }
+
+    size_t j = index(v->nodemap, bit);
+    node *sub = erase_impl(v->child(j), value, h, shift + bits, found);
+    if (!found) {
+        return nullptr;
+    }
+    try {
+        node *result;
+        if (sub->values() == 1 && sub->children() == 0) {
+            size_t i = index(v->datamap, bit);
+            result = make_node(false, v->datamap | bit, v->nodemap ^ bit, [&](size_t k) -> T const & {
+                return k < i ? v->value(k) : k == i ? sub->value(0) : v->value(k - 1);
+            }, [&](size_t k) {
+                return v->child(k < j ? k : k + 1);
+            });
+        } else {
+            result = make_node(false, v->datamap, v->nodemap, [&](size_t k) -> T const & {
+                return v->value(k);
+            }, [&](size_t k) {
+                return k == j ? sub : v->child(k);
+            });
+        }
+        release(sub);
+        return result;
+    } catch (...) {
+        release(sub);
+        throw;
+    }
+}
+
+// A new node with copies of value(0..) and references to child(0..), as many as the maps
+// give. If copying a value throws, nothing is left allocated.
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+template<typename ValueAt, typename ChildAt>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::node *
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::make_node(bool collision, std::uint32_t datamap,
+                                                                std::uint32_t nodemap, ValueAt value,
+                                                                ChildAt child) const {
+    size_t values = collision ? datamap : popcount(datamap);
+    size_t children = collision ? 0 : popcount(nodemap);
+    unit_allocator a(alloc);
+    size_t n = units(values, children);
+    unit *block = std::allocator_traits<unit_allocator>::allocate(a, n);
+    node *result = ::new(static_cast<void *>(block)) node(collision, datamap, nodemap);
+    T *slots = reinterpret_cast<T *>(reinterpret_cast<char *>(block) + values_offset);
+    size_t built = 0;
+    try {
+        for (; built < values; ++built) {
+            ::new(static_cast<void *>(slots + built)) T(value(built));
+        }
+    } catch (...) {
+        while (built > 0) {
+            slots[--built].~T();
+        }
+        result->~node();
+        std::allocator_traits<unit_allocator>::deallocate(a, block, n);
+        throw;
+    }
+    node **links = reinterpret_cast<node **>(reinterpret_cast<char *>(block) + children_offset(values));
+    for (size_t i = 0; i < children; ++i) {
+        links[i] = child(i);
+        RefCount::acquire(links[i]->refs);
+    }
+    return result;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+void persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::release(node *v) const {
+    if (!v || !RefCount::release(v->refs)) {
+        return;
+    }
+    size_t values = v->values();
+    size_t children = v->children();
+    for (size_t i = 0; i < children; ++i) {
+        release(v->child(i));
+    }
+    for (size_t i = 0; i < values; ++i) {
+        v->value(i).~T();
+    }
+    v->~node();
+    unit_allocator a(alloc);
+    std::allocator_traits<unit_allocator>::deallocate(a, reinterpret_cast<unit *>(v), units(values, children));
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+void swap(persistent_hash_set<T, Hash, Eq, RefCount, Allocator> &a,
+          persistent_hash_set<T, Hash, Eq, RefCount, Allocator> &b) {
+    a.swap(b);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::iterator(node *root) : depth(0) {
+    if (root) {
+        path[depth++] = {root, 0};
+        settle();
+    }
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::iterator(iterator const &other)
+        : depth(other.depth) {
+    std::copy(other.path, other.path + depth, path);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator &
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::operator=(iterator const &other) {
+    depth = other.depth;
+    std::copy(other.path, other.path + depth, path);
+    return *this;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::reference
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::operator*() const {
+    return path[depth - 1].v->value(path[depth - 1].pos);
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::pointer
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::operator->() const {
+    return &**this;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator &
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::operator++() {
+    ++path[depth - 1].pos;
+    settle();
+    return *this;
+}
+
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+typename persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator
+persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::operator++(int) {
+    iterator copy = *this;
+    ++*this;
+    return copy;
+}
+
+// Moves from the position in the last frame to the next value at or after it: the node's
+// values come first, then the values below each of its children.
+template<typename T, typename Hash, typename Eq, typename RefCount, typename Allocator>
+void persistent_hash_set<T, Hash, Eq, RefCount, Allocator>::iterator::settle() {
+    while (depth > 0) {
+        frame &top = path[depth - 1];
+        size_t values = top.v->values();
+        if (top.pos < values) {
+            return;
+        }
+        if (top.pos - values < top.v->children()) {
+            assert(depth < max_depth);
+            path[depth] = {top.v->child(top.pos - values), 0};
+            ++depth;
+        } else if (--depth > 0) {
+            ++path[depth - 1].pos;
+        }
+    }
+}
+
+#endif
@@ -5,15 +5,591 @@
 #include <iterator> // std::reverse_iterator
 #include <utility>  // std::pair, std::swap
 #include <memory>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <new>
+#include <exception>
+#include <vector>
+#include <algorithm> // std::max
+#include <cstddef>   // std::size_t
+#include <type_traits>
+#include <functional> // std::less
+#include <unordered_map>
+#include <string>
+#include <string_view>
+
+// Balancing policies for persistent_set. A policy owns the per-node bookkeeping
+// (`data`) and decides when the rebalancing step in persistent_set::balance rotates:
+//   update(self, left, right)      recompute `self` from the children (null = empty subtree)
+//   heavy(a, b)                    subtree `a` is too big next to sibling `b`
+//   single_rotation(inner, outer)  a single rotation fixes a heavy subtree with these children
+//   measure(v)                     grows strictly from a subtree to its parent (height or size)
+//   max_height                     bound on the height of any tree that fits in memory
+//   has_size                       whether size(data) gives the number of nodes in a subtree
+//   has_join                       whether the policy rebalances through join() instead
+// A policy whose invariant needs more than the two children (a color, say) sets has_join
+// and provides join(tree, self, left, right), which builds a balanced tree from `left`,
+// the node `self` and `right` of any heights; heavy() and single_rotation() go unused.
+// `tree` gives it meta(v), left(v) and right(v) to look at nodes, take_left(p) and
+// take_right(p) to detach children, and rebuild(self, left, right, paint), which calls
+// paint(data &) on the rebuilt node before update(). update() must keep whatever paint
+// stored, as new nodes start from value-initialized data and copies start from the
+// original's.
+// Everything is static, so the choice costs nothing at runtime.
+
+struct avl_balance {
+    struct data {
+        int height;
+    };
+
+    // An AVL tree of height 56 holds at least F(58) - 1 > 5 * 10^11 nodes.
+    static constexpr std::size_t max_height = 56;
+
+    static constexpr bool has_size = false;
+
+    static constexpr bool has_join = false;
+
+    static int height(data const *v) {
+        return v ? v->height : 0;
+    }
+
+    static std::size_t measure(data const *v) {
+        return static_cast<std::size_t>(height(v));
+    }
+
+    static void update(data &self, data const *left, data const *right) {
+        self.height = std::max(height(left), height(right)) + 1;
+    }
+
+    static bool heavy(data const *a, data const *b) {
+        return height(a) > height(b) + 1;
+    }
+
+    static bool single_rotation(data const *inner, data const *outer) {
+        return height(outer) >= height(inner);
+    }
+};
+
+// Adams' weight-balanced trees with the (delta, gamma) = (3, 2) parameters.
+struct weight_balance {
+    struct data {
+        std::size_t size;
+    };
+
+    static constexpr std::size_t delta = 3;
+    static constexpr std::size_t gamma = 2;
+
+    // A child weighs at most 3/4 of its parent (weight = size + 1), and min_size(96) is over
+    // 2 * 10^12 nodes.
+    static constexpr std::size_t max_height = 96;
+
+    static constexpr bool has_size = true;
+
+    static constexpr bool has_join = false;
+
+    static std::size_t size(data const *v) {
+        return v ? v->size : 0;
+    }
+
+    static std::size_t weight(data const *v) {
+        return size(v) + 1;
+    }
+
+    static std::size_t measure(data const *v) {
+        return size(v);
+    }
+
+    static void update(data &self, data const *left, data const *right) {
+        self.size = weight(left) + weight(right) - 1;
+    }
+
+    static bool heavy(data const *a, data const *b) {
+        return weight(a) > delta * weight(b);
+    }
+
+    static bool single_rotation(data const *inner, data const *outer) {
+        return weight(inner) < gamma * weight(outer);
+    }
+
+    // Fewest nodes in a tree of this height: each level adds a sibling a third as heavy as
+    // the subtree below it.
+    static constexpr std::uint64_t min_size(std::size_t height) {
+        std::uint64_t weight = 1;
+        for (std::size_t h = 0; h < height; h++) {
+            weight += (weight + delta - 1) / delta;
+        }
+        return weight - 1;
+    }
+};
+
+static_assert(weight_balance::min_size(weight_balance::max_height) > 2000000000000ull,
+              "weight_balance::max_height must bound the height of any tree that fits in memory");
+
+// Red-black trees joined as in Blelloch, Ferizovic and Sun, "Just Join for Parallel
+// Ordered Sets": a new node is red, and join() walks down the spine of the tree with more
+// black nodes, fixing a red child of a red node with one rotation on the way back up.
+struct red_black_balance {
+    struct data {
+        // Black nodes on a path from this node down to an empty subtree, itself included.
+        unsigned black_height : 31;
+        unsigned black : 1;
+    };
+
+    // A path has at most one red node per black one, so height 96 needs 2^48 - 1 nodes.
+    static constexpr std::size_t max_height = 96;
+
+    static constexpr bool has_size = false;
+
+    static constexpr bool has_join = true;
+
+    static unsigned black_height(data const *v) {
+        return v ? v->black_height : 0;
+    }
+
+    static bool red(data const *v) {
+        return v && !v->black;
+    }
+
+    static std::size_t measure(data const *v) {
+        return v ? 2 * std::size_t(v->black_height) + !v->black : 0;
+    }
+
+    static void update(data &self, data const *left, data const *) {
+        self.black_height = black_height(left) + self.black;
+    }
+
+    template<typename Tree, typename Ptr>
+    static Ptr join(Tree const &tree, Ptr self, Ptr left, Ptr right) {
+        unsigned l = black_height(tree.meta(left.get()));
+        unsigned r = black_height(tree.meta(right.get()));
+        if (l > r) {
+            Ptr result = join_right(tree, std::move(self), std::move(left), std::move(right), r);
+            if (red(tree.meta(result.get())) && red(tree.meta(tree.right(result.get())))) {
+                return repaint(tree, std::move(result), true);
+            }
+            return result;
+        } else if (r > l) {
+            Ptr result = join_left(tree, std::move(self), std::move(left), std::move(right), l);
+            if (red(tree.meta(result.get())) && red(tree.meta(tree.left(result.get())))) {
+                return repaint(tree, std::move(result), true);
+            }
+            return result;
+        }
+        bool black = red(tree.meta(left.get())) || red(tree.meta(right.get()));
+        return tree.rebuild(std::move(self), std::move(left), std::move(right), paint(black));
+    }
+
+private:
+    static auto paint(bool black) {
+        return [black](data &v) { v.black = black; };
+    }
+
+    static void keep(data &) {}
+
+    template<typename Tree, typename Ptr>
+    static Ptr repaint(Tree const &tree, Ptr v, bool black) {
+        Ptr left = tree.take_left(v);
+        Ptr right = tree.take_right(v);
+        return tree.rebuild(std::move(v), std::move(left), std::move(right), paint(black));
+    }
+
+    // Joins `right`, of black height `height`, to the right spine of the higher `left`.
+    // The result may be a red node with a red right child, which the caller fixes.
+    template<typename Tree, typename Ptr>
+    static Ptr join_right(Tree const &tree, Ptr self, Ptr left, Ptr right, unsigned height) {
+        if (!red(tree.meta(left.get())) && black_height(tree.meta(left.get())) == height) {
+            return tree.rebuild(std::move(self), std::move(left), std::move(right), paint(false));
+        }
+        Ptr outer = tree.take_left(left);
+        Ptr lower = join_right(tree, std::move(self), tree.take_right(left), std::move(right), height);
+        if (!red(tree.meta(left.get())) && red(tree.meta(lower.get())) &&
+            red(tree.meta(tree.right(lower.get())))) {
+            Ptr inner = tree.take_left(lower);
+            Ptr far = repaint(tree, tree.take_right(lower), true);
+            Ptr top = tree.rebuild(std::move(left), std::move(outer), std::move(inner), keep);
+            return tree.rebuild(std::move(lower), std::move(top), std::move(far), keep);
+        }
+        return tree.rebuild(std::move(left), std::move(outer), std::move(lower), keep);
+    }
+
+    template<typename Tree, typename Ptr>
+    static Ptr join_left(Tree const &tree, Ptr self, Ptr left, Ptr right, unsigned height) {
+        if (!red(tree.meta(right.get())) && black_height(tree.meta(right.get())) == height) {
+            return tree.rebuild(std::move(self), std::move(left), std::move(right), paint(false));
+        }
+        Ptr outer = tree.take_right(right);
+        Ptr lower = join_left(tree, std::move(self), std::move(left), tree.take_left(right), height);
+        if (!red(tree.meta(right.get())) && red(tree.meta(lower.get())) &&
+            red(tree.meta(tree.left(lower.get())))) {
+            Ptr inner = tree.take_right(lower);
+            Ptr far = repaint(tree, tree.take_left(lower), true);
+            Ptr top = tree.rebuild(std::move(right), std::move(inner), std::move(outer), keep);
+            return tree.rebuild(std::move(lower), std::move(far), std::move(top), keep);
+        }
+        return tree.rebuild(std::move(right), std::move(lower), std::move(outer), keep);
+    }
+};
+
+// Adds subtree sizes to another policy, enabling rank(), nth() and count_range().
+// weight_balance keeps sizes already and needs no adapter.
+template<typename Balance>
+struct order_statistics {
+    struct data {
+        typename Balance::data base;
+        std::size_t size;
+    };
+
+    static constexpr std::size_t max_height = Balance::max_height;
+
+    static constexpr bool has_size = true;
+
+    static constexpr bool has_join = Balance::has_join;
+
+    static typename Balance::data const *base(data const *v) {
+        return v ? &v->base : nullptr;
+    }
+
+    static std::size_t size(data const *v) {
+        return v ? v->size : 0;
+    }
+
+    static std::size_t measure(data const *v) {
+        return size(v);
+    }
+
+    static void update(data &self, data const *left, data const *right) {
+        Balance::update(self.base, base(left), base(right));
+        self.size = size(left) + size(right) + 1;
+    }
+
+    static bool heavy(data const *a, data const *b) {
+        return Balance::heavy(base(a), base(b));
+    }
+
+    static bool single_rotation(data const *inner, data const *outer) {
+        return Balance::single_rotation(base(inner), base(outer));
+    }
+
+    template<typename Tree, typename Ptr>
+    static Ptr join(Tree const &tree, Ptr self, Ptr left, Ptr right) {
+        return Balance::join(base_view<Tree>{tree}, std::move(self), std::move(left), std::move(right));
+    }
+
+private:
+    // Shows `Balance` the part of the data it owns.
+    template<typename Tree>
+    struct base_view {
+        Tree const &tree;
+
+        template<typename V>
+        typename Balance::data const *meta(V const *v) const {
+            return base(tree.meta(v));
+        }
+
+        template<typename V>
+        V *left(V *v) const {
+            return tree.left(v);
+        }
+
+        template<typename V>
+        V *right(V *v) const {
+            return tree.right(v);
+        }
+
+        template<typename Ptr>
+        Ptr take_left(Ptr &v) const {
+            return tree.take_left(v);
+        }
+
+        template<typename Ptr>
+        Ptr take_right(Ptr &v) const {
+            return tree.take_right(v);
+        }
+
+        template<typename Ptr, typename Paint>
+        Ptr rebuild(Ptr self, Ptr left, Ptr right, Paint paint) const {
+            return tree.rebuild(std::move(self), std::move(left), std::move(right),
+                                [&paint](data &v) { paint(v.base); });
+        }
+    };
+};
+
+// Reference counting policies for the intrusive counter embedded in every node.
+// atomic_refcount lets versions sharing nodes be used from different threads;
+// plain_refcount is cheaper when all versions stay on one thread.
+
+struct atomic_refcount {
+    typedef std::atomic<std::uint32_t> counter;
+
+    static constexpr bool thread_safe = true;
+
+    static void acquire(counter &c) {
+        c.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static bool release(counter &c) {
+        return c.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    static bool unique(counter const &c) {
+        return c.load(std::memory_order_acquire) == 1;
+    }
+};
+
+struct plain_refcount {
+    typedef std::uint32_t counter;
+
+    static constexpr bool thread_safe = false;
+
+    static void acquire(counter &c) {
+        ++c;
+    }
+
+    static bool release(counter &c) {
+        return --c == 0;
+    }
+
+    static bool unique(counter const &c) {
+        return c == 1;
+    }
+};
+
+// Memory held by a group of versions of a set: the nodes reachable from them, and the value
+// cells of those nodes, each counted once however many of the versions share it. Bytes are
+// the sizes of nodes and cells, without allocator overhead or memory owned by the values.
+struct set_memory_stats {
+    size_t nodes;
+    // Nodes reachable from more than one of the versions.
+    size_t shared_nodes;
+    size_t bytes;
+    // For each version, in the order given, what is reachable from it alone: what dropping
+    // it would free if these were all the versions.
+    std::vector<size_t> exclusive_nodes;
+    std::vector<size_t> exclusive_bytes;
+};
+
+// Whether persistent_set keeps values of type T in cells shared by all copies of a node, so
+// that path copying copies a pointer instead of the value. Worth it for values that are
+// expensive to copy; specialize it as std::true_type for them. Move-only values use cells
+// by default, which lets versions of a set of them share nodes like any other.
+template<typename T>
+struct shared_value : std::integral_constant<bool, !std::is_copy_constructible<T>::value> {};
+
+// Size-class pool for tree nodes. Blocks up to max_size bytes are served from per-thread
+// free lists that refill from and spill to a shared list per size class in batches, so
+// path copying does not go through malloc on every level. Pool memory is never returned
+// to the system; freed blocks are reused by later versions.
+struct node_pool {
+    static constexpr std::size_t granularity = alignof(std::max_align_t);
+    static constexpr std::size_t max_size = 256;
+    static constexpr std::size_t classes = max_size / granularity;
+    static constexpr std::size_t batch = 64;
+    static constexpr std::size_t chunk_size = 64 * 1024;
+
+    static void *allocate(std::size_t size, std::size_t align) {
+        if (size > max_size || align > granularity) {
+            return ::operator new(size, std::align_val_t(align));
+        }
+        std::size_t c = size_class(size);
+        cache &local = thread_cache();
+        if (local.dead) {
+            return take_shared(c);
+        }
+        if (!local.head[c]) {
+            refill(local, c);
+        }
+        block *result = local.head[c];
+        local.head[c] = result->next;
+        local.count[c]--;
+        return result;
+    }
+
+    static void deallocate(void *p, std::size_t size, std::size_t align) {
+        if (size > max_size || align > granularity) {
+            ::operator delete(p, std::align_val_t(align));
+            return;
+        }
+        std::size_t c = size_class(size);
+        block *b = static_cast<block *>(p);
+        cache &local = thread_cache();
+        if (local.dead) {
+            shard &global = shards()[c];
+            std::lock_guard<std::mutex> guard(global.lock);
+            b->next = global.head;
+            global.head = b;
+            return;
+        }
+        b->next = local.head[c];
+        local.head[c] = b;
+        if (++local.count[c] > 2 * batch) {
+            spill(local, c, batch);
+        }
+    }
+
+private:
+    struct block {
+        block *next;
+    };
+
+    struct shard {
+        std::mutex lock;
+        block *head = nullptr;
+    };
+
+    struct cache {
+        block *head[classes];
+        std::size_t count[classes];
+        bool registered;
+        bool dead;
+    };
+
+    // Returns the thread's blocks to the shared lists when the thread exits.
+    struct cache_flusher {
+        ~cache_flusher() {
+            cache &local = raw_cache();
+            for (std::size_t c = 0; c < classes; c++) {
+                spill(local, c, local.count[c]);
+            }
+            local.dead = true;
+        }
+    };
+
+    static std::size_t size_class(std::size_t size) {
+        return size == 0 ? 0 : (size - 1) / granularity;
+    }
+
+    static shard *shards() {
+        static shard *result = new shard[classes];
+        return result;
+    }
+
+    static cache &raw_cache() {
+        static thread_local cache local;
+        return local;
+    }
+
+    static cache &thread_cache() {
+        cache &local = raw_cache();
+        if (!local.registered) {
+            static thread_local cache_flusher flusher;
+            (void) flusher;
+            local.registered = true;
+        }
+        return local;
+    }
+
+    // Fills the shared list of class `c` from a new chunk; the caller holds its lock.
+    static void carve(shard &global, std::size_t c) {
+        std::size_t size = (c + 1) * granularity;
+        char *chunk = static_cast<char *>(::operator new(chunk_size));
+        for (std::size_t offset = 0; offset + size <= chunk_size; offset += size) {
+            block *b = reinterpret_cast<block *>(chunk + offset);
+            b->next = global.head;
+            global.head = b;
+        }
+    }
+
+    // Serves a block straight from the shared list, for threads whose cache is destroyed.
+    static block *take_shared(std::size_t c) {
+        shard &global = shards()[c];
+        std::lock_guard<std::mutex> guard(global.lock);
+        if (!global.head) {
+            carve(global, c);
+        }
+        block *result = global.head;
+        global.head = result->next;
+        return result;
+    }
+
+    static void refill(cache &local, std::size_t c) {
+        shard &global = shards()[c];
+        std::lock_guard<std::mutex> guard(global.lock);
+        if (!global.head) {
+            carve(global, c);
+        }
+        while (global.head && local.count[c] < batch) {
+            block *b = global.head;
+            global.head = b->next;
+            b->next = local.head[c];
+            local.head[c] = b;
+            local.count[c]++;
+        }
+    }
+
+    static void spill(cache &local, std::size_t c, std::size_t n) {
+        if (n == 0) {
+            return;
+        }
+        shard &global = shards()[c];
+        std::lock_guard<std::mutex> guard(global.lock);
+        for (; n > 0 && local.head[c]; n--) {
+            block *b = local.head[c];
+            local.head[c] = b->next;
+            local.count[c]--;
+            b->next = global.head;
+            global.head = b;
+        }
+    }
+};
 
+// Stateless allocator over node_pool, usable as the Allocator of persistent_set.
 template<typename T>
+struct pool_allocator {
+    typedef T value_type;
+
+    pool_allocator() noexcept = default;
+
+    template<typename U>
+    pool_allocator(pool_allocator<U> const &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(node_pool::allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        node_pool::deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    friend bool operator==(pool_allocator const &, pool_allocator const &) {
+        return true;
+    }
+
+    friend bool operator!=(pool_allocator const &, pool_allocator const &) {
+        return false;
+    }
+};
+
+template<typename T, typename Balance = avl_balance, typename RefCount = atomic_refcount,
+        typename Allocator = std::allocator<T>, typename Compare = std::less<T>>
+struct persistent_set_cell;
+
+// Versions share nodes, so every copy of a set keeps the allocator of its source
+// (allocator propagation traits are ignored): nodes are always freed by the allocator
+// that created them, whichever version drops them last.
+// Path copying copies values unless shared_value<T> puts them in shared cells, so copying a
+// version (and set algebra, whose results share nodes with the operands) needs either.
+// A set of move-only values without cells can still be moved and updated; it never shares
+// nodes, so updates happen in place.
+// Compare is a strict weak order, as for std::set; with a transparent Compare
+// (e.g. std::less<>), lookups accept any key type it can compare with T.
+template<typename T, typename Balance = avl_balance, typename RefCount = atomic_refcount,
+        typename Allocator = std::allocator<T>, typename Compare = std::less<T>>
 struct persistent_set {
     typedef T value_type;
+    typedef Allocator allocator_type;
+    typedef Compare key_compare;
+    typedef Compare value_compare;
     struct bNode;
     struct node;
+    struct value_cell;
 
 
     struct iterator;
+    struct transient_set;
+    struct reclaimer;
     using const_iterator = iterator;
     using reverse_iterator = std::reverse_iterator<iterator>;
     using const_reverse_iterator = std::reverse_iterator<const_iterator>;
@@ -29,98 +605,499 @@ struct persistent_set {
 
     persistent_set();
 
+    explicit persistent_set(Allocator const &alloc);
+
+    explicit persistent_set(Compare const &comp, Allocator const &alloc = Allocator());
+
+    template<typename InputIt>
+    persistent_set(InputIt first, InputIt last, Allocator const &alloc = Allocator());
+
+    template<typename InputIt>
+    persistent_set(InputIt first, InputIt last, Compare const &comp, Allocator const &alloc = Allocator());
+
+    template<typename InputIt>
+    static persistent_set from_sorted(InputIt first, InputIt last, Allocator const &alloc = Allocator());
+
+    template<typename InputIt>
+    static persistent_set from_sorted(InputIt first, InputIt last, Compare const &comp,
+                                      Allocator const &alloc = Allocator());
+
     persistent_set(persistent_set const &);
 
-    //persistent_set &operator=(persistent_set const &other);
+    persistent_set(persistent_set &&other) noexcept;
+
+    persistent_set &operator=(persistent_set const &other);
+
+    persistent_set &operator=(persistent_set &&other) noexcept;
 
-    //~persistent_set();
+    ~persistent_set();
 
     void clear();
 
     bool empty() const;
 
+    size_t size() const;
+
 
     void swap(persistent_set &other);
 
+    allocator_type get_allocator() const;
+
+    key_compare key_comp() const;
+
+    void set_reclaimer(reclaimer *r);
+
+    reclaimer *get_reclaimer() const;
+
     iterator find(T const &value) const;
 
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(K const &key) const;
+
+    size_t count(T const &value) const;
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t count(K const &key) const;
+
+    iterator lower_bound(T const &value) const;
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(K const &key) const;
+
+    iterator upper_bound(T const &value) const;
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(K const &key) const;
+
+    std::pair<iterator, iterator> equal_range(T const &value) const;
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<iterator, iterator> equal_range(K const &key) const;
+
+    struct range_view;
+
+    // Elements in [lo, hi); like iterators, the view is valid while the set is.
+    range_view range(T const &lo, T const &hi) const;
+
+    // One descent from the root, as many comparisons as find(), which also gathers the
+    // returned iterator's ancestors; a value already present is neither copied nor allocated.
     std::pair<iterator, bool> insert(T const &value);
 
+    std::pair<iterator, bool> insert(T &&value);
+
+    // Constructs the value first, since its position depends on it, and moves it into the node.
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args &&... args);
+
     void erase(iterator const &it);
 
+    size_t erase(T const &value);
+
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t erase(K const &key);
+
+    // Batch updates: the changes are sorted and applied in one descent that splits them at
+    // each node, so every node on the paths to them is copied once rather than once per
+    // change. O(k log(n / k + 1)) for k changes. insert_batch and erase_batch return the
+    // number of elements inserted or erased; apply takes (value, insert) pairs, and the last
+    // change to a value wins.
+
+    template<typename InputIt>
+    size_t insert_batch(InputIt first, InputIt last);
+
+    template<typename InputIt>
+    size_t erase_batch(InputIt first, InputIt last);
+
+    template<typename InputIt>
+    void apply(InputIt first, InputIt last);
+
+    transient_set transient() const;
+
+    // Order statistics, O(log n); they need a Balance policy with subtree sizes
+    // (weight_balance or order_statistics<...>).
+
+    size_t rank(T const &value) const;
+
+    iterator nth(size_t k) const;
+
+    size_t count_range(T const &lo, T const &hi) const;
+
+    // Set algebra by split and join: O(m log(n / m + 1)) for sizes m <= n. Subtrees that are
+    // not affected, and subtrees the two versions share, end up in the result as they are.
+    // Both sets must use equal allocators. With a Balance policy that has no subtree sizes,
+    // computing the result's size walks the parts of the smaller operand that the other lacks.
+
+    friend persistent_set set_union(persistent_set const &a, persistent_set const &b) {
+        distinct_count only(a, b);
+        node_ptr root = a.union_impl(a.root_of(), b.root_of(), only);
+        return a.with_root(std::move(root), a._size + b._size - only.common());
+    }
+
+    friend persistent_set set_intersection(persistent_set const &a, persistent_set const &b) {
+        distinct_count only(a, b);
+        node_ptr root = a.intersection_impl(a.root_of(), b.root_of(), only);
+        return a.with_root(std::move(root), only.common());
+    }
+
+    friend persistent_set set_difference(persistent_set const &a, persistent_set const &b) {
+        distinct_count only(a, b);
+        node_ptr root = a.difference_impl(a.root_of(), b.root_of(), only);
+        return a.with_root(std::move(root), a._size - only.common());
+    }
+
+    friend persistent_set symmetric_difference(persistent_set const &a, persistent_set const &b) {
+        distinct_count only(a, b);
+        node_ptr root = a.symmetric_difference_impl(a.root_of(), b.root_of(), only);
+        return a.with_root(std::move(root), a._size + b._size - 2 * only.common());
+    }
+
+    // Calls removed(x) for every x in `a` but not in `b`, and added(x) for every x in `b` but
+    // not in `a`, in increasing order. Both trees are walked in lockstep and the subtrees they
+    // share are skipped, so versions k updates apart are compared in O(k log n).
+    template<typename Removed, typename Added>
+    friend void diff(persistent_set const &a, persistent_set const &b, Removed removed, Added added) {
+        a.diff_impl(b, removed, added);
+    }
+
+    // memory_stats(a, b, ...) for versions a, b, ..., or memory_stats(first, last) for a
+    // range of them. O(nodes); subtrees found shared are walked once more to mark them.
+    template<typename... Sets>
+    friend set_memory_stats memory_stats(persistent_set const &first, Sets const &... rest) {
+        persistent_set const *versions[] = {&first, &rest...};
+        return memory_stats_impl(versions, 1 + sizeof...(rest));
+    }
+
+    template<typename InputIt>
+    static set_memory_stats memory_stats(InputIt first, InputIt last);
+
     struct bNode {
         friend struct persistent_set;
-        std::shared_ptr<bNode> left;
-        std::shared_ptr<bNode> right;
+        bNode *left;
+        bNode *right;
+        typename Balance::data meta;
+        typename RefCount::counter refs;
 
         bNode();
 
-        bNode(std::shared_ptr<bNode> const &left, std::shared_ptr<bNode> const &right)
-                : left(left), right(right) {}
-
         T &get_value();
 
         bNode *min();
 
         bNode *max();
 
-        bNode *next(bNode *root);
-
-        bNode *prev(bNode *root);
+        static typename Balance::data const *meta_of(bNode const *v) {
+            return v ? &v->meta : nullptr;
+        }
     };
 
 private:
+    struct node_ptr;
 
-    void tree_();
+    // Sign of the order of a and b from a single comparison where possible: Compare::compare
+    // if the comparator has one, a.compare(b) for standard strings and string views under
+    // std::less, and a branch-free difference for arithmetic keys under std::less. Any other
+    // compare() member is not assumed to agree with operator<.
+    template<typename A, typename B>
+    int compare(A const &a, B const &b) const;
 
-    std::shared_ptr<bNode> erase_impl(bNode *pos, bNode *pos2);
+    template<typename C, typename A, typename B, typename = void>
+    struct has_compare : std::false_type {};
 
-    std::shared_ptr<bNode> insert_impl(bNode *pos, T const &value, bNode *&result);
+    template<typename C, typename A, typename B>
+    struct has_compare<C, A, B, decltype(void(std::declval<C const &>().compare(std::declval<A const &>(),
+                                                                               std::declval<B const &>())))>
+            : std::true_type {};
 
-    std::shared_ptr<bNode> tree;
+    template<typename A, typename B, typename = void>
+    struct has_member_compare : std::false_type {};
 
-    size_t _size;
-};
+    template<typename A, typename B>
+    struct has_member_compare<A, B, decltype(void(std::declval<A const &>().compare(std::declval<B const &>())))>
+            : std::true_type {};
 
+    template<typename A>
+    struct is_string : std::false_type {};
 
-template<typename T>
-struct persistent_set<T>::node : bNode {
-    node(T const &value) : value(value) {}
+    template<typename C, typename Traits, typename Alloc>
+    struct is_string<std::basic_string<C, Traits, Alloc>> : std::true_type {};
 
-    node(std::shared_ptr<bNode> const &left, std::shared_ptr<bNode> const &right, T const &value)
-            : bNode(left, right), value(value) {}
+    template<typename C, typename Traits>
+    struct is_string<std::basic_string_view<C, Traits>> : std::true_type {};
 
-private:
-    friend struct bNode;
-    T value;
-};
+    template<typename A, typename B>
+    static constexpr bool string_compare = is_string<A>::value && has_member_compare<A, B>::value;
 
-template<typename T>
-typename persistent_set<T>::const_iterator persistent_set<T>::begin() const {
-    if (!tree || !tree->left) {
-        return end();
-    }
-    return const_iterator(tree.get()->min(), tree.get());
-}
+    static constexpr bool natural_order = std::is_same<Compare, std::less<T>>::value ||
+                                          std::is_same<Compare, std::less<>>::value;
 
+    template<typename K>
+    iterator find_impl(K const &key) const;
 
-template<typename T>
-typename persistent_set<T>::const_iterator persistent_set<T>::end() const {
-    return const_iterator(tree.get(), tree.get());
-}
+    struct diff_cursor;
 
-template<typename T>
-typename persistent_set<T>::const_reverse_iterator persistent_set<T>::rbegin() const {
-    return const_reverse_iterator(end());
-}
+    struct join_view;
 
-template<typename T>
-typename persistent_set<T>::const_reverse_iterator persistent_set<T>::rend() const {
+    template<typename Removed, typename Added>
+    void diff_impl(persistent_set const &other, Removed &removed, Added &added) const;
+
+    static set_memory_stats memory_stats_impl(persistent_set const *const *versions, size_t n);
+
+    template<typename K>
+    iterator bound(K const &key, bool upper) const;
+
+    template<typename K>
+    std::pair<iterator, iterator> equal_range_impl(K const &key) const;
+
+    template<typename K>
+    size_t erase_key(K const &key);
+
+    node_ptr erase_impl(bNode *pos, bNode *pos2);
+
+    template<typename V>
+    std::pair<iterator, bool> insert_value(V &&value);
+
+    template<typename V>
+    node_ptr insert_impl(bNode *pos, V &&value, iterator &at);
+
+    typedef std::pair<T, bool> change;
+
+    struct change_value;
+
+    void apply_changes(std::vector<change> &changes, size_t &inserted, size_t &erased);
+
+    node_ptr batch_impl(bNode *pos, change *first, change *last, size_t &inserted, size_t &erased) const;
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<node> node_allocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<bNode> root_allocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<value_cell> cell_allocator;
+
+    static constexpr bool shared_values = shared_value<T>::value;
+
+    // Whether a node can be copied for path copying.
+    static constexpr bool copyable_nodes = shared_values || std::is_copy_constructible<T>::value;
+
+    template<typename V>
+    node_ptr insert_mut(node_ptr pos, V &&value, bool &inserted, iterator &at) const;
+
+    node_ptr erase_mut(node_ptr pos, T const &value, bool &erased) const;
+
+    node_ptr erase_min_mut(node_ptr pos, node_ptr &minimum) const;
+
+    node_ptr balance(node_ptr self, node_ptr left, node_ptr right, iterator *track = nullptr) const;
+
+    node_ptr join(node_ptr self, node_ptr left, node_ptr right) const;
+
+    node_ptr join2(node_ptr left, node_ptr right) const;
+
+    node_ptr split_last(node_ptr pos, node_ptr &last) const;
+
+    void split(bNode *pos, T const &value, node_ptr &left, node_ptr &right, bool &found) const;
+
+    node_ptr join_or_share(bNode *pos, node_ptr left, node_ptr right) const;
+
+    // Counts the elements of the smaller operand of set algebra that the other one lacks:
+    // the pieces of it that meet an empty subtree of the other, and its nodes that splitting
+    // the other did not find. What is left of it is common to both, including the subtrees
+    // the operands share, which are never walked.
+    struct distinct_count {
+        distinct_count(persistent_set const &a, persistent_set const &b)
+                : of_b(b._size < a._size), size(of_b ? b._size : a._size), n(0) {}
+
+        void piece_of_a(bNode *v) {
+            if (!of_b)
+                n += subtree_size(v);
+        }
+
+        void piece_of_b(bNode *v) {
+            if (of_b)
+                n += subtree_size(v);
+        }
+
+        void node_of_a() {
+            if (!of_b)
+                n++;
+        }
+
+        void node_of_b() {
+            if (of_b)
+                n++;
+        }
+
+        size_t common() const {
+            return size - n;
+        }
+
+    private:
+        bool of_b;
+        size_t size;
+        size_t n;
+    };
+
+    node_ptr union_impl(bNode *a, bNode *b, distinct_count &only) const;
+
+    node_ptr intersection_impl(bNode *a, bNode *b, distinct_count &only) const;
+
+    node_ptr difference_impl(bNode *a, bNode *b, distinct_count &only) const;
+
+    node_ptr symmetric_difference_impl(bNode *a, bNode *b, distinct_count &only) const;
+
+    static size_t subtree_size(bNode *v);
+
+    bNode *root_of() const;
+
+    persistent_set with_root(node_ptr root, size_t size) const;
+
+    node_ptr rebuild(node_ptr src, node_ptr left, node_ptr right, iterator *track = nullptr) const;
+
+    template<typename... Args>
+    node_ptr make_node(node_ptr left, node_ptr right, Args &&... args) const;
+
+    template<typename... Args>
+    node_ptr new_node(node_ptr left, node_ptr right, typename Balance::data const &meta, Args &&... args) const;
+
+    node_ptr copy_node(node_ptr left, node_ptr right, bNode *src) const;
+
+    void release_cell(value_cell *cell) const;
+
+    node_ptr share(bNode *v) const;
+
+    template<typename It>
+    node_ptr build_sorted(size_t n, It &it) const;
+
+    node_ptr left_of(node_ptr const &v) const;
+
+    node_ptr right_of(node_ptr const &v) const;
+
+    bNode *exclusive_tree();
+
+    bNode *make_root(node_ptr left) const;
+
+    void release(bNode *v) const;
+
+    bNode *release_step(bNode *cur) const;
+
+    void destroy(bNode *v) const;
+
+    void release_tree(bNode *root) const;
+
+    static void assign_alloc(Allocator &to, Allocator const &from);
+
+    friend struct persistent_set_cell<T, Balance, RefCount, Allocator, Compare>;
+
+    bNode *tree;
+
+    size_t _size;
+
+    Allocator alloc;
+
+    Compare comp;
+
+    reclaimer *reclaim;
+};
+
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::node : bNode {
+    template<typename... Args>
+    explicit node(Args &&... args) : value(std::forward<Args>(args)...) {}
+
+private:
+    friend struct bNode;
+    friend struct persistent_set;
+    typename std::conditional<shared_values, value_cell *, T>::type value;
+};
+
+// A value shared by the copies of a node, freed with the last of them.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::value_cell {
+    template<typename... Args>
+    explicit value_cell(Args &&... args) : refs(1), value(std::forward<Args>(args)...) {}
+
+    typename RefCount::counter refs;
+    T value;
+};
+
+// Owning reference to a node, used while a new version is being built so that
+// partially built paths are released if a copy of T or an allocation throws.
+// A node_ptr without a set only borrows a node of an existing version.
+// A node that is owned through the only reference to it is exclusive and may be
+// updated in place instead of being copied.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr {
+    node_ptr() : p(nullptr), set(nullptr) {}
+
+    explicit node_ptr(bNode *p) : p(p), set(nullptr) {}
+
+    node_ptr(bNode *p, persistent_set const *set) : p(p), set(set) {}
+
+    node_ptr(node_ptr &&other) noexcept : p(other.take()), set(other.set) {}
+
+    node_ptr &operator=(node_ptr &&other) noexcept {
+        std::swap(p, other.p);
+        std::swap(set, other.set);
+        return *this;
+    }
+
+    ~node_ptr() {
+        if (p && set)
+            set->release(p);
+    }
+
+    bool exclusive() const {
+        return p && set && RefCount::unique(p->refs);
+    }
+
+    bNode *get() const {
+        return p;
+    }
+
+    bNode *operator->() const {
+        return p;
+    }
+
+    explicit operator bool() const {
+        return p != nullptr;
+    }
+
+    bNode *take() {
+        bNode *result = p;
+        p = nullptr;
+        return result;
+    }
+
+private:
+    bNode *p;
+    persistent_set const *set;
+};
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::const_iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::begin() const {
+    if (!tree || !tree->left) {
+        return end();
+    }
+    const_iterator result(tree, tree);
+    result.leftmost(tree->left);
+    return result;
+}
+
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::const_iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::end() const {
+    return const_iterator(tree, tree);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::const_reverse_iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::rbegin() const {
+    return const_reverse_iterator(end());
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::const_reverse_iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::rend() const {
     return const_reverse_iterator(begin());
 }
 
-template<typename T>
-struct persistent_set<T>::iterator {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator {
     using iterator_category = std::bidirectional_iterator_tag;
     using difference_type = std::ptrdiff_t;
     using value_type = T const;
@@ -129,283 +1106,2137 @@ struct persistent_set<T>::iterator {
 
     iterator() = default;
 
+    iterator(iterator const &other);
+
+    iterator &operator=(iterator const &other);
+
     reference operator*() const;
 
-    pointer operator->() const;
+    pointer operator->() const;
+
+    iterator &operator++();
+
+    iterator operator++(int);
+
+    iterator &operator--();
+
+    iterator operator--(int);
+
+    friend bool operator==(iterator const &a, iterator const &b) {
+        return a._node == b._node;
+    }
+
+    friend bool operator!=(iterator const &a, iterator const &b) {
+        return a._node != b._node;
+    }
+
+private:
+    friend struct persistent_set;
+    bNode *_node;
+    bNode *root;
+    // Ancestors of _node from the top of the tree, so stepping never searches from the root.
+    bNode *path[Balance::max_height];
+    size_t depth;
+
+    explicit iterator(bNode *_node, bNode *root) : _node(_node), root(root), depth(0) {}
+
+    void push(bNode *v);
+
+    void leftmost(bNode *v);
+
+    void rightmost(bNode *v);
+
+    void follow(bNode *src, bNode *v);
+};
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::range_view {
+    iterator begin() const {
+        return first;
+    }
+
+    iterator end() const {
+        return last;
+    }
+
+    bool empty() const {
+        return first == last;
+    }
+
+private:
+    friend struct persistent_set;
+
+    range_view(iterator first, iterator last) : first(first), last(last) {}
+
+    iterator first;
+    iterator last;
+};
+
+// The rest of a tree in order: a stack of whole subtrees and of single nodes whose left
+// subtrees have been passed already.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::diff_cursor {
+    struct entry {
+        bNode *v;
+        bool whole;
+    };
+
+    explicit diff_cursor(bNode *root) : depth(0) {
+        if (root)
+            push(root, true);
+    }
+
+    bool empty() const {
+        return depth == 0;
+    }
+
+    entry top() const {
+        return stack[depth - 1];
+    }
+
+    void pop() {
+        --depth;
+    }
+
+    // Replaces the whole subtree on top by its left subtree, its root and its right subtree.
+    void expand() {
+        bNode *v = stack[--depth].v;
+        if (v->right)
+            push(v->right, true);
+        push(v, false);
+        if (v->left)
+            push(v->left, true);
+    }
+
+private:
+    void push(bNode *v, bool whole) {
+        assert(depth < 2 * Balance::max_height + 1);
+        stack[depth++] = {v, whole};
+    }
+
+    entry stack[2 * Balance::max_height + 1];
+    size_t depth;
+};
+
+// What a Balance policy with its own join() sees of the tree: see the policy notes at the top.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::join_view {
+    persistent_set const &set;
+    iterator *track;
+
+    static typename Balance::data const *meta(bNode const *v) {
+        return bNode::meta_of(v);
+    }
+
+    static bNode *left(bNode *v) {
+        return v ? v->left : nullptr;
+    }
+
+    static bNode *right(bNode *v) {
+        return v ? v->right : nullptr;
+    }
+
+    node_ptr take_left(node_ptr &v) const {
+        return set.left_of(v);
+    }
+
+    node_ptr take_right(node_ptr &v) const {
+        return set.right_of(v);
+    }
+
+    template<typename Paint>
+    node_ptr rebuild(node_ptr self, node_ptr left, node_ptr right, Paint paint) const {
+        node_ptr result = set.rebuild(std::move(self), std::move(left), std::move(right), track);
+        paint(result->meta);
+        Balance::update(result->meta, meta(result->left), meta(result->right));
+        return result;
+    }
+};
+
+// Deferred reclamation of dropped versions. A set attached to a reclaimer hands the root of
+// each version it drops to the reclaimer in O(1); the nodes are freed later, either a bounded
+// number after every insert/erase of an attached set, by explicit collect() calls, or by a
+// background thread after start(). The background thread needs a thread-safe RefCount, and
+// the allocator must be usable from it.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer {
+    explicit reclaimer(size_t step = 64, Allocator const &alloc = Allocator())
+            : owner(alloc), step(step), current(nullptr), background(false), stopping(false) {}
+
+    reclaimer(reclaimer const &) = delete;
+
+    reclaimer &operator=(reclaimer const &) = delete;
+
+    ~reclaimer();
+
+    // Frees at most about `budget` nodes; returns the number of steps done.
+    size_t collect(size_t budget);
+
+    void collect_all();
+
+    bool idle() const;
+
+    void start();
+
+    void stop();
+
+private:
+    friend struct persistent_set;
+
+    void defer(bNode *v);
+
+    void tick();
+
+    void run();
+
+    persistent_set owner;
+    size_t step;
+    std::vector<bNode *> queue;
+    bNode *current;
+    bool background;
+    bool stopping;
+    mutable std::mutex lock;
+    std::condition_variable wakeup;
+    std::thread worker;
+};
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::~reclaimer() {
+    stop();
+    collect_all();
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::collect(size_t budget) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t done = 0;
+    for (; done < budget; done++) {
+        if (current) {
+            current = owner.release_step(current);
+        } else if (!queue.empty()) {
+            bNode *v = queue.back();
+            queue.pop_back();
+            if (RefCount::release(v->refs))
+                current = v;
+        } else {
+            break;
+        }
+    }
+    return done;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::collect_all() {
+    while (collect(1024) == 1024) {}
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+bool persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::idle() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return !current && queue.empty();
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::start() {
+    static_assert(RefCount::thread_safe, "background reclamation needs a thread-safe RefCount policy");
+    std::lock_guard<std::mutex> guard(lock);
+    if (!background) {
+        background = true;
+        stopping = false;
+        worker = std::thread(&reclaimer::run, this);
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!background)
+            return;
+        stopping = true;
+    }
+    wakeup.notify_one();
+    worker.join();
+    std::lock_guard<std::mutex> guard(lock);
+    background = false;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::defer(bNode *v) {
+    try {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(v);
+    } catch (...) {
+        owner.release(v);
+        return;
+    }
+    wakeup.notify_one();
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::tick() {
+    bool incremental;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        incremental = !background && (current || !queue.empty());
+    }
+    if (incremental)
+        collect(step);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer::run() {
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wakeup.wait(guard, [this] {
+                return stopping || current || !queue.empty();
+            });
+            if (stopping)
+                return;
+        }
+        collect(step);
+    }
+}
+
+// Batch builder: updates nodes it created in place and copies only the nodes still shared
+// with the version it was created from. Iterators obtained from it are invalidated by the
+// next update. If an update throws, the transient is left empty.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::transient_set {
+    transient_set(transient_set &&other) noexcept : set(other.set.comp, other.set.get_allocator()) {
+        set.swap(other.set);
+    }
+
+    transient_set(transient_set const &) = delete;
+
+    transient_set &operator=(transient_set const &) = delete;
+
+    bool insert(T const &value);
+
+    bool erase(T const &value);
+
+    iterator find(T const &value) const {
+        return set.find(value);
+    }
+
+    size_t size() const {
+        return set._size;
+    }
+
+    bool empty() const {
+        return set.empty();
+    }
+
+    persistent_set persistent();
+
+private:
+    friend struct persistent_set;
+
+    explicit transient_set(persistent_set const &source) : set(source) {}
+
+    persistent_set set;
+};
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+bool persistent_set<T, Balance, RefCount, Allocator, Compare>::transient_set::insert(T const &value) {
+    bNode *tree = set.exclusive_tree();
+    node_ptr root(tree->left, &set);
+    tree->left = nullptr;
+    bool inserted = false;
+    iterator at(nullptr, nullptr);
+    try {
+        tree->left = set.insert_mut(std::move(root), value, inserted, at).take();
+    } catch (...) {
+        set.clear();
+        throw;
+    }
+    if (inserted)
+        set._size++;
+    return inserted;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+bool persistent_set<T, Balance, RefCount, Allocator, Compare>::transient_set::erase(T const &value) {
+    bNode *tree = set.exclusive_tree();
+    node_ptr root(tree->left, &set);
+    tree->left = nullptr;
+    bool erased = false;
+    try {
+        tree->left = set.erase_mut(std::move(root), value, erased).take();
+    } catch (...) {
+        set.clear();
+        throw;
+    }
+    if (erased)
+        set._size--;
+    return erased;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare> persistent_set<T, Balance, RefCount, Allocator, Compare>::transient_set::persistent() {
+    persistent_set result(set.comp, set.get_allocator());
+    result.swap(set);
+    return result;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::transient_set
+persistent_set<T, Balance, RefCount, Allocator, Compare>::transient() const {
+    return transient_set(*this);
+}
+
+// The sentinel of a version being updated in place; a shared one is replaced by a copy first.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode *
+persistent_set<T, Balance, RefCount, Allocator, Compare>::exclusive_tree() {
+    if (!tree) {
+        tree = make_root(node_ptr());
+    } else if (!RefCount::unique(tree->refs)) {
+        bNode *tmp_tree = make_root(share(tree->left));
+        release_tree(tree);
+        tree = tmp_tree;
+    }
+    return tree;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::persistent_set() : alloc(), comp() {
+    tree = nullptr;
+    _size = 0;
+    reclaim = nullptr;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::persistent_set(Allocator const &alloc) : alloc(alloc), comp() {
+    tree = nullptr;
+    _size = 0;
+    reclaim = nullptr;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::persistent_set(Compare const &comp, Allocator const &alloc)
+        : alloc(alloc), comp(comp) {
+    tree = nullptr;
+    _size = 0;
+    reclaim = nullptr;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename InputIt>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::persistent_set(InputIt first, InputIt last, Allocator const &alloc)
+        : persistent_set(first, last, Compare(), alloc) {}
+
+// Sorts and deduplicates the range, then builds the tree bottom-up like from_sorted.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename InputIt>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::persistent_set(InputIt first, InputIt last, Compare const &comp,
+                                                          Allocator const &alloc)
+        : alloc(alloc), comp(comp) {
+    tree = nullptr;
+    _size = 0;
+    reclaim = nullptr;
+    std::vector<T> values(first, last);
+    std::sort(values.begin(), values.end(), comp);
+    values.erase(std::unique(values.begin(), values.end(), [&comp](T const &a, T const &b) {
+        return !comp(a, b);
+    }), values.end());
+    from_sorted(std::make_move_iterator(values.begin()), std::make_move_iterator(values.end()), comp, alloc).swap(*this);
+}
+
+// Builds a perfectly balanced tree from a strictly increasing range in O(n),
+// allocating one node per element.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename InputIt>
+persistent_set<T, Balance, RefCount, Allocator, Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::from_sorted(InputIt first, InputIt last, Allocator const &alloc) {
+    return from_sorted(first, last, Compare(), alloc);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename InputIt>
+persistent_set<T, Balance, RefCount, Allocator, Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::from_sorted(InputIt first, InputIt last, Compare const &comp,
+                                                       Allocator const &alloc) {
+    typedef typename std::iterator_traits<InputIt>::iterator_category category;
+    if constexpr (!std::is_base_of<std::forward_iterator_tag, category>::value) {
+        std::vector<T> values(first, last);
+        return from_sorted(std::make_move_iterator(values.begin()), std::make_move_iterator(values.end()), comp, alloc);
+    } else {
+        assert(std::adjacent_find(first, last, [&comp](T const &a, T const &b) {
+            return !comp(a, b);
+        }) == last);
+
+        persistent_set result(comp, alloc);
+        size_t n = static_cast<size_t>(std::distance(first, last));
+        if (n != 0) {
+            result.tree = result.make_root(result.build_sorted(n, first));
+            result._size = n;
+        }
+        return result;
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename It>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::build_sorted(size_t n, It &it) const {
+    if (n == 0) {
+        return node_ptr();
+    }
+    node_ptr left = build_sorted(n / 2, it);
+    node_ptr result = make_node(node_ptr(), node_ptr(), *it);
+    ++it;
+    node_ptr right = build_sorted(n - n / 2 - 1, it);
+    return join(std::move(result), std::move(left), std::move(right));
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::swap(persistent_set &other) {
+    std::swap(tree, other.tree);
+    std::swap(_size, other._size);
+    std::swap(reclaim, other.reclaim);
+    std::swap(comp, other.comp);
+    Allocator tmp(alloc);
+    assign_alloc(alloc, other.alloc);
+    assign_alloc(other.alloc, tmp);
+}
+
+// Allocators need not be assignable (std::pmr::polymorphic_allocator is not), so they are re-created in place.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::assign_alloc(Allocator &to, Allocator const &from) {
+    if (&to != &from) {
+        to.~Allocator();
+        ::new(static_cast<void *>(&to)) Allocator(from);
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::allocator_type
+persistent_set<T, Balance, RefCount, Allocator, Compare>::get_allocator() const {
+    return alloc;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::key_compare
+persistent_set<T, Balance, RefCount, Allocator, Compare>::key_comp() const {
+    return comp;
+}
+
+// Versions dropped by this set, and by sets copied from it afterwards, are handed to `r`
+// instead of being freed on the spot. `r` must outlive all of them and use an equal allocator.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::set_reclaimer(reclaimer *r) {
+    reclaim = r;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::reclaimer *
+persistent_set<T, Balance, RefCount, Allocator, Compare>::get_reclaimer() const {
+    return reclaim;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::find(T const &value) const {
+    return find_impl(value);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::find(K const &key) const {
+    return find_impl(key);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::count(T const &value) const {
+    return find_impl(value) != end();
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::count(K const &key) const {
+    return find_impl(key) != end();
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::find_impl(K const &key) const {
+    if (!tree) {
+        return end();
+    } else {
+        iterator result(tree, tree);
+        auto cur = tree->left;
+        for (;;) {
+            if (cur == nullptr) {
+                return end();
+            } else {
+                int c = compare(key, cur->get_value());
+                if (c < 0) {
+                    result.push(cur);
+                    cur = cur->left;
+                } else if (c > 0) {
+                    result.push(cur);
+                    cur = cur->right;
+                } else {
+                    result._node = cur;
+                    return result;
+                }
+            }
+        }
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::lower_bound(T const &value) const {
+    return bound(value, false);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::lower_bound(K const &key) const {
+    return bound(key, false);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::upper_bound(T const &value) const {
+    return bound(value, true);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::upper_bound(K const &key) const {
+    return bound(key, true);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+std::pair<typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator, typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::equal_range(T const &value) const {
+    return equal_range_impl(value);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+std::pair<typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator, typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::equal_range(K const &key) const {
+    return equal_range_impl(key);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+std::pair<typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator, typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::equal_range_impl(K const &key) const {
+    iterator first = bound(key, false);
+    iterator last = first;
+    if (last != end() && !comp(key, *last)) {
+        ++last;
+    }
+    return {first, last};
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::range_view persistent_set<T, Balance, RefCount, Allocator, Compare>::range(T const &lo, T const &hi) const {
+    iterator first = lower_bound(lo);
+    return range_view(first, comp(lo, hi) ? lower_bound(hi) : first);
+}
+
+// First element not less than `key` (greater than it if `upper`). The path is filled during
+// the descent: the ancestors of the answer are a prefix of the nodes visited.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::bound(K const &key, bool upper) const {
+    if (!tree) {
+        return end();
+    }
+    iterator result(tree, tree);
+    bNode *found = tree;
+    size_t found_depth = 0;
+    for (bNode *cur = tree->left; cur;) {
+        if (upper ? comp(key, cur->get_value()) : !comp(cur->get_value(), key)) {
+            found = cur;
+            found_depth = result.depth;
+            result.push(cur);
+            cur = cur->left;
+        } else {
+            result.push(cur);
+            cur = cur->right;
+        }
+    }
+    result._node = found;
+    result.depth = found_depth;
+    return result;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename A, typename B>
+int persistent_set<T, Balance, RefCount, Allocator, Compare>::compare(A const &a, B const &b) const {
+    if constexpr (has_compare<Compare, A, B>::value) {
+        int r = comp.compare(a, b);
+        return (r > 0) - (r < 0);
+    } else if constexpr (natural_order && std::is_arithmetic<A>::value && std::is_arithmetic<B>::value) {
+        return (b < a) - (a < b);
+    } else if constexpr (natural_order && string_compare<A, B>) {
+        int r = a.compare(b);
+        return (r > 0) - (r < 0);
+    } else if constexpr (natural_order && string_compare<B, A>) {
+        int r = b.compare(a);
+        return (r < 0) - (r > 0);
+    } else {
+        return comp(a, b) ? -1 : comp(b, a) ? 1 : 0;
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename Removed, typename Added>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::diff_impl(persistent_set const &other, Removed &removed, Added &added) const {
+    diff_cursor a(root_of());
+    diff_cursor b(other.root_of());
+    while (!a.empty() && !b.empty()) {
+        auto x = a.top();
+        auto y = b.top();
+        if (x.whole && y.whole && x.v == y.v) {
+            a.pop();
+            b.pop();
+        } else if (x.whole && (!y.whole || Balance::measure(bNode::meta_of(x.v)) >=
+                                           Balance::measure(bNode::meta_of(y.v)))) {
+            a.expand();
+        } else if (y.whole) {
+            b.expand();
+        } else {
+            int c = compare(x.v->get_value(), y.v->get_value());
+            if (c < 0) {
+                removed(x.v->get_value());
+                a.pop();
+            } else if (c > 0) {
+                added(y.v->get_value());
+                b.pop();
+            } else {
+                a.pop();
+                b.pop();
+            }
+        }
+    }
+    for (; !a.empty(); a.pop()) {
+        while (a.top().whole)
+            a.expand();
+        removed(a.top().v->get_value());
+    }
+    for (; !b.empty(); b.pop()) {
+        while (b.top().whole)
+            b.expand();
+        added(b.top().v->get_value());
+    }
+}
+
+// Number of elements less than `value`.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::rank(T const &value) const {
+    static_assert(Balance::has_size, "rank() needs a Balance policy with subtree sizes");
+    size_t result = 0;
+    for (bNode *cur = root_of(); cur;) {
+        if (comp(cur->get_value(), value)) {
+            result += subtree_size(cur->left) + 1;
+            cur = cur->right;
+        } else {
+            cur = cur->left;
+        }
+    }
+    return result;
+}
+
+// The k-th smallest element (from 0), or end() if there are at most k elements.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::nth(size_t k) const {
+    static_assert(Balance::has_size, "nth() needs a Balance policy with subtree sizes");
+    if (k >= _size) {
+        return end();
+    }
+    iterator result(tree, tree);
+    bNode *cur = tree->left;
+    for (;;) {
+        size_t left = subtree_size(cur->left);
+        if (k < left) {
+            result.push(cur);
+            cur = cur->left;
+        } else if (k > left) {
+            k -= left + 1;
+            result.push(cur);
+            cur = cur->right;
+        } else {
+            result._node = cur;
+            return result;
+        }
+    }
+}
+
+// Number of elements in [lo, hi).
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::count_range(T const &lo, T const &hi) const {
+    if (!comp(lo, hi)) {
+        return 0;
+    }
+    return rank(hi) - rank(lo);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+std::pair<typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator, bool> persistent_set<T, Balance, RefCount, Allocator, Compare>::insert(T const &value) {
+    return insert_value(value);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+std::pair<typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator, bool> persistent_set<T, Balance, RefCount, Allocator, Compare>::insert(T &&value) {
+    return insert_value(std::move(value));
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename... Args>
+std::pair<typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator, bool> persistent_set<T, Balance, RefCount, Allocator, Compare>::emplace(Args &&... args) {
+    return insert_value(T(std::forward<Args>(args)...));
+}
+
+// A set of move-only values without cells is the only owner of its nodes, so it is updated
+// in place like a transient (and left empty if that throws). The returned iterator gathers
+// its ancestors bottom-up while the descent unwinds.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename V>
+std::pair<typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator, bool> persistent_set<T, Balance, RefCount, Allocator, Compare>::insert_value(V &&value) {
+    iterator at(nullptr, nullptr);
+    bool inserted = false;
+    if constexpr (!copyable_nodes) {
+        bNode *sentinel = exclusive_tree();
+        node_ptr root(sentinel->left, this);
+        sentinel->left = nullptr;
+        try {
+            sentinel->left = insert_mut(std::move(root), std::forward<V>(value), inserted, at).take();
+        } catch (...) {
+            clear();
+            throw;
+        }
+        if (inserted)
+            _size++;
+    } else {
+        node_ptr root = insert_impl(tree ? tree->left : nullptr, std::forward<V>(value), at);
+        if (root) {
+            bNode *tmp_tree = make_root(std::move(root));
+
+            release_tree(tree);
+            tree = tmp_tree;
+            _size++;
+            inserted = true;
+            if (reclaim)
+                reclaim->tick();
+        }
+    }
+    at.root = tree;
+    std::reverse(at.path, at.path + at.depth);
+    return {at, inserted};
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::erase(T const &value) {
+    return erase_key(value);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K, typename C, typename>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::erase(K const &key) {
+    return erase_key(key);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename K>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::erase_key(K const &key) {
+    iterator it = find_impl(key);
+    if (it == end()) {
+        return 0;
+    }
+    erase(it);
+    return 1;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::erase(const persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator &it) {
+    if (!tree || !tree->left) {
+        return;
+    }
+    if constexpr (!copyable_nodes) {
+        bNode *sentinel = exclusive_tree();
+        node_ptr root(sentinel->left, this);
+        sentinel->left = nullptr;
+        bool erased = false;
+        try {
+            sentinel->left = erase_mut(std::move(root), it._node->get_value(), erased).take();
+        } catch (...) {
+            clear();
+            throw;
+        }
+        _size--;
+    } else {
+        bNode *tmp_tree = make_root(erase_impl(tree->left, it._node));
+
+        release_tree(tree);
+        tree = tmp_tree;
+        _size--;
+        if (reclaim)
+            reclaim->tick();
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename InputIt>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::insert_batch(InputIt first, InputIt last) {
+    std::vector<change> changes;
+    for (; first != last; ++first) {
+        changes.emplace_back(*first, true);
+    }
+    size_t inserted = 0, erased = 0;
+    apply_changes(changes, inserted, erased);
+    return inserted;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename InputIt>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::erase_batch(InputIt first, InputIt last) {
+    std::vector<change> changes;
+    for (; first != last; ++first) {
+        changes.emplace_back(*first, false);
+    }
+    size_t inserted = 0, erased = 0;
+    apply_changes(changes, inserted, erased);
+    return erased;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename InputIt>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::apply(InputIt first, InputIt last) {
+    std::vector<change> changes(first, last);
+    size_t inserted = 0, erased = 0;
+    apply_changes(changes, inserted, erased);
+}
+
+// Reads the values of a run of insertions for build_sorted.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set<T, Balance, RefCount, Allocator, Compare>::change_value {
+    change *pos;
+
+    T const &operator*() const {
+        return pos->first;
+    }
+
+    change_value &operator++() {
+        ++pos;
+        return *this;
+    }
+};
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::apply_changes(std::vector<change> &changes,
+                                                                             size_t &inserted, size_t &erased) {
+    static_assert(std::is_copy_constructible<T>::value, "batches copy their values");
+    std::stable_sort(changes.begin(), changes.end(), [this](change const &a, change const &b) {
+        return comp(a.first, b.first);
+    });
+    // Keep the last change of every run of equal values.
+    size_t kept = 0;
+    for (size_t i = 0; i < changes.size(); i++) {
+        if (i + 1 < changes.size() && !comp(changes[i].first, changes[i + 1].first)) {
+            continue;
+        }
+        if (kept != i) {
+            changes[kept] = changes[i];
+        }
+        kept++;
+    }
+    changes.erase(changes.begin() + static_cast<std::ptrdiff_t>(kept), changes.end());
+    if (changes.empty()) {
+        return;
+    }
+
+    node_ptr root = batch_impl(root_of(), changes.data(), changes.data() + changes.size(), inserted, erased);
+    if (root.get() == root_of()) {
+        return;
+    }
+    bNode *tmp_tree = root ? make_root(std::move(root)) : nullptr;
+
+    release_tree(tree);
+    tree = tmp_tree;
+    _size = _size + inserted - erased;
+    if (reclaim)
+        reclaim->tick();
+}
+
+// The subtree at `pos` with the sorted changes [first, last) applied. The changes are split
+// around the value of each node on the way down; a node whose subtrees come back unchanged
+// is shared, and the others are rebuilt once by join, which also rebalances subtrees that
+// grew or shrank by more than one level.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::batch_impl(bNode *pos, change *first, change *last,
+                                                                     size_t &inserted, size_t &erased) const {
+    if (first == last) {
+        return share(pos);
+    }
+    if (!pos) {
+        // Erasing absent values does nothing; the insertions form a balanced subtree.
+        last = std::remove_if(first, last, [](change const &c) {
+            return !c.second;
+        });
+        size_t n = static_cast<size_t>(last - first);
+        inserted += n;
+        change_value it = {first};
+        return build_sorted(n, it);
+    }
+    T const &value = pos->get_value();
+    change *mid = std::lower_bound(first, last, value, [this](change const &c, T const &v) {
+        return comp(c.first, v);
+    });
+    bool found = mid != last && !comp(value, mid->first);
+    node_ptr left = batch_impl(pos->left, first, mid, inserted, erased);
+    node_ptr right = batch_impl(pos->right, found ? mid + 1 : mid, last, inserted, erased);
+    if (found && !mid->second) {
+        erased++;
+        return join2(std::move(left), std::move(right));
+    }
+    return join_or_share(pos, std::move(left), std::move(right));
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename V>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::insert_impl(persistent_set::bNode *pos, V &&value, iterator &at) {
+    if (!pos) {
+        auto _new = make_node(node_ptr(), node_ptr(), std::forward<V>(value));
+        at._node = _new.get();
+        return _new;
+    }
+    int c = compare(value, pos->get_value());
+    if (c > 0) {
+
+        node_ptr right = insert_impl(pos->right, std::forward<V>(value), at);
+        if (!right) {
+            at.push(pos);
+            return right;
+        }
+        return balance(node_ptr(pos), share(pos->left), std::move(right), &at);
+
+    } else if (c < 0) {
+
+        node_ptr left = insert_impl(pos->left, std::forward<V>(value), at);
+        if (!left) {
+            at.push(pos);
+            return left;
+        }
+        return balance(node_ptr(pos), std::move(left), share(pos->right), &at);
+
+    } else {
+
+        // Already present: nothing has been copied yet, and nothing will be.
+        at._node = pos;
+        return node_ptr();
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::erase_impl(persistent_set::bNode *pos, persistent_set::bNode *pos2) {
+    if (pos == pos2) {
+
+        if (!pos2->right) {
+            return share(pos2->left);
+
+        } else if (!pos2->left) {
+            return share(pos2->right);
+
+        } else {
+
+            bNode *minimum = pos->right->min();
+            return balance(node_ptr(minimum), share(pos->left), erase_impl(pos->right, minimum));
+        }
+
+    } else if (comp(pos->get_value(), pos2->get_value())) {
+        return balance(node_ptr(pos), share(pos->left), erase_impl(pos->right, pos2));
+    } else {
+        return balance(node_ptr(pos), erase_impl(pos->left, pos2), share(pos->right));
+    }
+}
+
+// Transient counterparts of insert_impl and erase_impl: they consume a reference to the
+// subtree and return the new subtree, updating exclusive nodes in place and copying the
+// ones still shared with other versions.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename V>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::insert_mut(node_ptr pos, V &&value, bool &inserted,
+                                                                     iterator &at) const {
+    if (!pos) {
+        inserted = true;
+        node_ptr created = make_node(node_ptr(), node_ptr(), std::forward<V>(value));
+        at._node = created.get();
+        return created;
+
+    }
+    int c = compare(value, pos->get_value());
+    if (c > 0) {
+
+        node_ptr right = insert_mut(right_of(pos), std::forward<V>(value), inserted, at);
+        if (!inserted) {
+            if (pos.exclusive())
+                pos->right = right.take();
+            at.push(pos.get());
+            return pos;
+        }
+        node_ptr left = left_of(pos);
+        return balance(std::move(pos), std::move(left), std::move(right), &at);
+
+    } else if (c < 0) {
+
+        node_ptr left = insert_mut(left_of(pos), std::forward<V>(value), inserted, at);
+        if (!inserted) {
+            if (pos.exclusive())
+                pos->left = left.take();
+            at.push(pos.get());
+            return pos;
+        }
+        node_ptr right = right_of(pos);
+        return balance(std::move(pos), std::move(left), std::move(right), &at);
+
+    } else {
+
+        inserted = false;
+        at._node = pos.get();
+        return pos;
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::erase_mut(node_ptr pos, T const &value, bool &erased) const {
+    if (!pos) {
+        erased = false;
+        return pos;
 
-    iterator &operator++();
+    }
+    int c = compare(value, pos->get_value());
+    if (c > 0) {
+
+        node_ptr right = erase_mut(right_of(pos), value, erased);
+        if (!erased) {
+            if (pos.exclusive())
+                pos->right = right.take();
+            return pos;
+        }
+        node_ptr left = left_of(pos);
+        return balance(std::move(pos), std::move(left), std::move(right));
 
-    iterator operator++(int);
+    } else if (c < 0) {
 
-    iterator &operator--();
+        node_ptr left = erase_mut(left_of(pos), value, erased);
+        if (!erased) {
+            if (pos.exclusive())
+                pos->left = left.take();
+            return pos;
+        }
+        node_ptr right = right_of(pos);
+        return balance(std::move(pos), std::move(left), std::move(right));
 
-    iterator operator--(int);
+    } else {
 
-    friend bool operator==(iterator const &a, iterator const &b) {
-        return a._node == b._node;
+        erased = true;
+        node_ptr left = left_of(pos);
+        node_ptr right = right_of(pos);
+        if (!right) {
+            return left;
+        } else if (!left) {
+            return right;
+        } else {
+            node_ptr minimum;
+            right = erase_min_mut(std::move(right), minimum);
+            return balance(std::move(minimum), std::move(left), std::move(right));
+        }
     }
+}
 
-    friend bool operator!=(iterator const &a, iterator const &b) {
-        return a._node != b._node;
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::erase_min_mut(node_ptr pos, node_ptr &minimum) const {
+    if (!pos->left) {
+        node_ptr right = right_of(pos);
+        minimum = std::move(pos);
+        return right;
+    } else {
+        node_ptr left = erase_min_mut(left_of(pos), minimum);
+        node_ptr right = right_of(pos);
+        return balance(std::move(pos), std::move(left), std::move(right));
     }
+}
 
-private:
-    friend struct persistent_set;
-    bNode *_node;
-    bNode *root;
-
-    explicit iterator(bNode *_node, bNode *root) : _node(_node), root(root) {}
-};
-
-template<typename T>
-persistent_set<T>::persistent_set() {
-    tree = nullptr;
-    _size = 0;
+// Joins two trees of any heights around `self`, whose value lies between them: walks down
+// the spine of the taller tree to a subtree that balances with the shorter one, and
+// rebalances on the way back up. O(difference in heights).
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::join(node_ptr self, node_ptr left, node_ptr right) const {
+    if constexpr (Balance::has_join) {
+        return Balance::join(join_view{*this, nullptr}, std::move(self), std::move(left), std::move(right));
+    } else if (Balance::heavy(bNode::meta_of(left.get()), bNode::meta_of(right.get()))) {
+        node_ptr outer = left_of(left);
+        node_ptr inner = right_of(left);
+        node_ptr lower = join(std::move(self), std::move(inner), std::move(right));
+        return balance(std::move(left), std::move(outer), std::move(lower));
+    } else if (Balance::heavy(bNode::meta_of(right.get()), bNode::meta_of(left.get()))) {
+        node_ptr outer = right_of(right);
+        node_ptr inner = left_of(right);
+        node_ptr lower = join(std::move(self), std::move(left), std::move(inner));
+        return balance(std::move(right), std::move(lower), std::move(outer));
+    } else {
+        return rebuild(std::move(self), std::move(left), std::move(right));
+    }
 }
 
-template<typename T>
-void persistent_set<T>::swap(persistent_set &other) {
-    std::swap(tree, other.tree);
-    std::swap(_size, other._size);
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::join2(node_ptr left, node_ptr right) const {
+    if (!left) {
+        return right;
+    } else if (!right) {
+        return left;
+    }
+    node_ptr last;
+    left = split_last(std::move(left), last);
+    return join(std::move(last), std::move(left), std::move(right));
 }
 
-template<typename T>
-typename persistent_set<T>::iterator persistent_set<T>::find(T const &value) const {
-    if (!tree) {
-        return end();
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::split_last(node_ptr pos, node_ptr &last) const {
+    if (!pos->right) {
+        node_ptr left = left_of(pos);
+        last = std::move(pos);
+        return left;
     } else {
-        auto cur = tree->left.get();
-        for (;;) {
-            if (cur == nullptr) {
-                return end();
-            } else {
-                if (cur->get_value() > value) {
-                    cur = cur->left.get();
-                } else if (cur->get_value() < value) {
-                    cur = cur->right.get();
-                } else {
-                    return iterator(cur, tree.get());
-                }
-            }
-        }
+        node_ptr left = left_of(pos);
+        node_ptr right = split_last(right_of(pos), last);
+        return balance(std::move(pos), std::move(left), std::move(right));
     }
 }
 
-template<typename T>
-std::pair<typename persistent_set<T>::iterator, bool> persistent_set<T>::insert(T const &value) {
-    tree_();
-    auto res = find(value);
-    if (res != end()) {
-        return {res, false};
+// Splits the subtree at `pos` into the values below and above `value`.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::split(bNode *pos, T const &value, node_ptr &left,
+                                                                     node_ptr &right, bool &found) const {
+    if (!pos) {
+        left = node_ptr();
+        right = node_ptr();
+        found = false;
+        return;
+    }
+    int c = compare(value, pos->get_value());
+    if (c < 0) {
+        node_ptr inner;
+        split(pos->left, value, left, inner, found);
+        right = join(node_ptr(pos), std::move(inner), share(pos->right));
+    } else if (c > 0) {
+        node_ptr inner;
+        split(pos->right, value, inner, right, found);
+        left = join(node_ptr(pos), share(pos->left), std::move(inner));
     } else {
-        bNode *result = nullptr;
-        auto tmp_tree = std::make_shared<persistent_set<T>::bNode>();
-        tmp_tree->left = insert_impl(tree->left.get(), value, result);
+        left = share(pos->left);
+        right = share(pos->right);
+        found = true;
+    }
+}
 
-        tree = tmp_tree;
-        _size++;
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::join_or_share(bNode *pos, node_ptr left, node_ptr right) const {
+    if (left.get() == pos->left && right.get() == pos->right) {
+        return share(pos);
+    }
+    return join(node_ptr(pos), std::move(left), std::move(right));
+}
 
-        return {persistent_set<T>::iterator(result, tree.get()), true};
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::union_impl(bNode *a, bNode *b, distinct_count &only) const {
+    if (a == b) {
+        return share(a);
+    } else if (!a) {
+        only.piece_of_b(b);
+        return share(b);
+    } else if (!b) {
+        only.piece_of_a(a);
+        return share(a);
     }
+    node_ptr below, above;
+    bool found;
+    split(b, a->get_value(), below, above, found);
+    if (!found)
+        only.node_of_a();
+    node_ptr left = union_impl(a->left, below.get(), only);
+    node_ptr right = union_impl(a->right, above.get(), only);
+    return join_or_share(a, std::move(left), std::move(right));
 }
 
-template<typename T>
-void persistent_set<T>::erase(const persistent_set<T>::iterator &it) {
-    if (tree && tree->left) {
-        auto tmp_tree = std::make_shared<persistent_set<T>::bNode>();
-        tmp_tree->left = erase_impl(tree->left.get(), it._node);
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::intersection_impl(bNode *a, bNode *b, distinct_count &only) const {
+    if (a == b) {
+        return share(a);
+    } else if (!a) {
+        only.piece_of_b(b);
+        return node_ptr();
+    } else if (!b) {
+        only.piece_of_a(a);
+        return node_ptr();
+    }
+    node_ptr below, above;
+    bool found;
+    split(b, a->get_value(), below, above, found);
+    node_ptr left = intersection_impl(a->left, below.get(), only);
+    node_ptr right = intersection_impl(a->right, above.get(), only);
+    if (found) {
+        return join_or_share(a, std::move(left), std::move(right));
+    }
+    only.node_of_a();
+    return join2(std::move(left), std::move(right));
+}
 
-        tree = tmp_tree;
-        _size--;
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::difference_impl(bNode *a, bNode *b, distinct_count &only) const {
+    if (a == b) {
+        return node_ptr();
+    } else if (!a) {
+        only.piece_of_b(b);
+        return node_ptr();
+    } else if (!b) {
+        only.piece_of_a(a);
+        return share(a);
     }
+    node_ptr below, above;
+    bool found;
+    split(a, b->get_value(), below, above, found);
+    if (!found)
+        only.node_of_b();
+    node_ptr left = difference_impl(below.get(), b->left, only);
+    node_ptr right = difference_impl(above.get(), b->right, only);
+    return join2(std::move(left), std::move(right));
 }
 
-template<typename T>
-typename persistent_set<T>::bNode *persistent_set<T>::bNode::next(persistent_set::bNode *root) {
-    if (right) {
-        return right->min();
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::symmetric_difference_impl(bNode *a, bNode *b, distinct_count &only) const {
+    if (a == b) {
+        return node_ptr();
+    } else if (!a) {
+        only.piece_of_b(b);
+        return share(b);
+    } else if (!b) {
+        only.piece_of_a(a);
+        return share(a);
+    }
+    node_ptr below, above;
+    bool found;
+    split(b, a->get_value(), below, above, found);
+    node_ptr left = symmetric_difference_impl(a->left, below.get(), only);
+    node_ptr right = symmetric_difference_impl(a->right, above.get(), only);
+    if (found) {
+        return join2(std::move(left), std::move(right));
+    }
+    only.node_of_a();
+    return join_or_share(a, std::move(left), std::move(right));
+}
 
-    } else {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::subtree_size(bNode *v) {
+    if constexpr (Balance::has_size) {
+        return Balance::size(bNode::meta_of(v));
+    }
+    bNode *stack[Balance::max_height];
+    size_t depth = 0;
+    size_t result = 0;
+    while (v || depth > 0) {
+        if (v) {
+            stack[depth++] = v;
+            v = v->left;
+        } else {
+            v = stack[--depth]->right;
+            result++;
+        }
+    }
+    return result;
+}
 
-        auto cur = root->left;
-        auto result = root;
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename InputIt>
+set_memory_stats persistent_set<T, Balance, RefCount, Allocator, Compare>::memory_stats(InputIt first, InputIt last) {
+    std::vector<persistent_set const *> versions;
+    for (; first != last; ++first) {
+        versions.push_back(&*first);
+    }
+    return memory_stats_impl(versions.data(), versions.size());
+}
 
-        for (;;) {
-            if (cur->get_value() < get_value()) {
-                cur = cur->right;
-            } else if (cur->get_value() > get_value()) {
-                result = cur.get();
-                cur = cur->left;
-            } else {
-                return result;
+// Every node (and cell) is marked with the one version it was reached from, or as shared
+// once a second version reaches it; the walk from a version stops at nodes already marked
+// with it or shared, since everything below them is too.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+set_memory_stats persistent_set<T, Balance, RefCount, Allocator, Compare>::memory_stats_impl(persistent_set const *const *versions,
+                                                                                           size_t n) {
+    typedef std::unordered_map<void const *, size_t> owner_map;
+    size_t const shared = n;
+    owner_map nodes, cells;
+    size_t reachable = 0;
+    for (size_t i = 0; i < n; i++) {
+        reachable += versions[i]->_size;
+    }
+    nodes.reserve(reachable);
+    if (shared_values)
+        cells.reserve(reachable);
+
+    // Marks `p` as reached from version i; false if that changes nothing.
+    auto mark = [shared](owner_map &owners, void const *p, size_t i) {
+        auto entry = owners.emplace(p, i);
+        if (entry.second) {
+            return true;
+        } else if (entry.first->second == i || entry.first->second == shared) {
+            return false;
+        }
+        entry.first->second = shared;
+        return true;
+    };
+    std::vector<bNode *> stack;
+    for (size_t i = 0; i < n; i++) {
+        if (bNode *root = versions[i]->root_of()) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            bNode *v = stack.back();
+            stack.pop_back();
+            if (!mark(nodes, v, i)) {
+                continue;
             }
+            if constexpr (shared_values) {
+                mark(cells, static_cast<node *>(v)->value, i);
+            }
+            if (v->left)
+                stack.push_back(v->left);
+            if (v->right)
+                stack.push_back(v->right);
         }
+    }
 
+    set_memory_stats result = {0, 0, 0, std::vector<size_t>(n), std::vector<size_t>(n)};
+    auto tally = [&result, shared](owner_map const &owners, size_t bytes) {
+        for (auto const &entry : owners) {
+            result.bytes += bytes;
+            if (entry.second != shared) {
+                result.exclusive_bytes[entry.second] += bytes;
+            }
+        }
+    };
+    tally(nodes, sizeof(node));
+    tally(cells, sizeof(value_cell));
+    result.nodes = nodes.size();
+    for (auto const &entry : nodes) {
+        if (entry.second == shared) {
+            result.shared_nodes++;
+        } else {
+            result.exclusive_nodes[entry.second]++;
+        }
     }
+    return result;
 }
 
-template<typename T>
-typename persistent_set<T>::bNode *persistent_set<T>::bNode::prev(persistent_set::bNode *root) {
-    if (left) {
-        return left->max();
-
-    } else {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode *persistent_set<T, Balance, RefCount, Allocator, Compare>::root_of() const {
+    return tree ? tree->left : nullptr;
+}
 
-        auto cur = root->left;
-        auto result = root;
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::with_root(node_ptr root, size_t size) const {
+    static_assert(copyable_nodes, "the result shares nodes with the operands");
+    persistent_set result(comp, alloc);
+    result.reclaim = reclaim;
+    if (root) {
+        result.tree = make_root(std::move(root));
+        result._size = size;
+    }
+    return result;
+}
 
-        for (;;) {
-            if (cur->get_value() < get_value()) {
-                result = cur.get();
-                cur = cur->right;
-            } else if (cur->get_value() > get_value()) {
-                cur = cur->left;
-            } else {
-                return result;
-            }
+// Rebalancing of a node being rebuilt from `self` with new children: one insert or erase
+// below it moves its children at most one step out of balance, so a single or double
+// rotation chosen by the policy restores the invariant and only the O(log n) nodes on
+// the search path are copied. Nodes moved by a rotation go through rebuild too, so ones
+// created during this operation are reused; *track, if given, follows the node insert()
+// placed and its ancestors through them.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::balance(node_ptr self, node_ptr left, node_ptr right,
+                                                                  iterator *track) const {
+    if constexpr (Balance::has_join) {
+        return Balance::join(join_view{*this, track}, std::move(self), std::move(left), std::move(right));
+    } else if (Balance::heavy(bNode::meta_of(left.get()), bNode::meta_of(right.get()))) {
+        if (Balance::single_rotation(bNode::meta_of(left->right), bNode::meta_of(left->left))) {
+            node_ptr outer = left_of(left);
+            node_ptr inner = right_of(left);
+            node_ptr lower = rebuild(std::move(self), std::move(inner), std::move(right), track);
+            return rebuild(std::move(left), std::move(outer), std::move(lower), track);
+        } else {
+            node_ptr outer = left_of(left);
+            node_ptr mid = right_of(left);
+            node_ptr mid_left = left_of(mid);
+            node_ptr mid_right = right_of(mid);
+            node_ptr lower_left = rebuild(std::move(left), std::move(outer), std::move(mid_left), track);
+            node_ptr lower_right = rebuild(std::move(self), std::move(mid_right), std::move(right), track);
+            return rebuild(std::move(mid), std::move(lower_left), std::move(lower_right), track);
+        }
 
+    } else if (Balance::heavy(bNode::meta_of(right.get()), bNode::meta_of(left.get()))) {
+        if (Balance::single_rotation(bNode::meta_of(right->left), bNode::meta_of(right->right))) {
+            node_ptr outer = right_of(right);
+            node_ptr inner = left_of(right);
+            node_ptr lower = rebuild(std::move(self), std::move(left), std::move(inner), track);
+            return rebuild(std::move(right), std::move(lower), std::move(outer), track);
+        } else {
+            node_ptr outer = right_of(right);
+            node_ptr mid = left_of(right);
+            node_ptr mid_left = left_of(mid);
+            node_ptr mid_right = right_of(mid);
+            node_ptr lower_left = rebuild(std::move(self), std::move(left), std::move(mid_left), track);
+            node_ptr lower_right = rebuild(std::move(right), std::move(mid_right), std::move(outer), track);
+            return rebuild(std::move(mid), std::move(lower_left), std::move(lower_right), track);
         }
+
+    } else {
+        return rebuild(std::move(self), std::move(left), std::move(right), track);
     }
 }
 
-template<typename T>
-std::shared_ptr<typename persistent_set<T>::bNode>
-persistent_set<T>::insert_impl(persistent_set::bNode *pos, const T &value, persistent_set::bNode *&result) {
-    if (!pos) {
-        auto _new = std::make_shared<typename persistent_set<T>::node>(value);
-        result = _new.get();
-        return _new;
-
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::rebuild(node_ptr src, node_ptr left, node_ptr right,
+                                                                  iterator *track) const {
+    if (src.exclusive()) {
+        release(src->left);
+        release(src->right);
+        Balance::update(src->meta, bNode::meta_of(left.get()), bNode::meta_of(right.get()));
+        src->left = left.take();
+        src->right = right.take();
+        if (track) {
+            track->follow(src.get(), src.get());
+        }
+        return src;
+    }
+    bNode *origin = src.get();
+    auto result = copy_node(std::move(left), std::move(right), origin);
+    if (track) {
+        track->follow(origin, result.get());
+    }
+    return result;
+}
 
-    } else if (pos->get_value() < value) {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename... Args>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::make_node(node_ptr left, node_ptr right, Args &&... args) const {
+    if constexpr (shared_values) {
+        cell_allocator a(alloc);
+        value_cell *cell = std::allocator_traits<cell_allocator>::allocate(a, 1);
+        try {
+            std::allocator_traits<cell_allocator>::construct(a, cell, std::forward<Args>(args)...);
+        } catch (...) {
+            std::allocator_traits<cell_allocator>::deallocate(a, cell, 1);
+            throw;
+        }
+        try {
+            return new_node(std::move(left), std::move(right), typename Balance::data(), cell);
+        } catch (...) {
+            release_cell(cell);
+            throw;
+        }
+    } else {
+        return new_node(std::move(left), std::move(right), typename Balance::data(), std::forward<Args>(args)...);
+    }
+}
 
-        return std::make_shared<typename persistent_set<T>::node>
-                (pos->left, insert_impl(pos->right.get(), value, result), pos->get_value());
+// Allocates a node holding a value, or a cell, constructed from `args`, with the policy
+// data `meta` updated for its children.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+template<typename... Args>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::new_node(node_ptr left, node_ptr right,
+                                                                   typename Balance::data const &meta,
+                                                                   Args &&... args) const {
+    node_allocator a(alloc);
+    node *result = std::allocator_traits<node_allocator>::allocate(a, 1);
+    try {
+        std::allocator_traits<node_allocator>::construct(a, result, std::forward<Args>(args)...);
+    } catch (...) {
+        std::allocator_traits<node_allocator>::deallocate(a, result, 1);
+        throw;
+    }
+    result->meta = meta;
+    Balance::update(result->meta, bNode::meta_of(left.get()), bNode::meta_of(right.get()));
+    result->left = left.take();
+    result->right = right.take();
+    return node_ptr(result, this);
+}
 
+// A copy of the shared node `src` with new children, sharing its value cell if it has one.
+// Nodes of move-only values without cells are never shared (see insert_value), so they are
+// never copied.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::copy_node(node_ptr left, node_ptr right, bNode *src) const {
+    if constexpr (shared_values) {
+        value_cell *cell = static_cast<node *>(src)->value;
+        RefCount::acquire(cell->refs);
+        try {
+            return new_node(std::move(left), std::move(right), src->meta, cell);
+        } catch (...) {
+            release_cell(cell);
+            throw;
+        }
+    } else if constexpr (std::is_copy_constructible<T>::value) {
+        return new_node(std::move(left), std::move(right), src->meta, src->get_value());
     } else {
+        assert(false && "a node of a move-only value is shared");
+        std::terminate();
+    }
+}
 
-        return std::make_shared<typename persistent_set<T>::node>
-                (insert_impl(pos->left.get(), value, result), pos->right, pos->get_value());
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::release_cell(value_cell *cell) const {
+    if (RefCount::release(cell->refs)) {
+        cell_allocator a(alloc);
+        std::allocator_traits<cell_allocator>::destroy(a, cell);
+        std::allocator_traits<cell_allocator>::deallocate(a, cell, 1);
     }
 }
 
-template<typename T>
-std::shared_ptr<typename persistent_set<T>::bNode>
-persistent_set<T>::erase_impl(persistent_set::bNode *pos, persistent_set::bNode *pos2) {
-    if (pos == pos2) {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr persistent_set<T, Balance, RefCount, Allocator, Compare>::share(bNode *v) const {
+    if (v) {
+        RefCount::acquire(v->refs);
+    }
+    return node_ptr(v, this);
+}
 
-        if (!pos2->right) {
-            return pos2->left;
+// Children of an exclusive node are detached (the caller takes over the node's reference),
+// children of a shared node are shared.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::left_of(node_ptr const &v) const {
+    if (v.exclusive()) {
+        node_ptr result(v->left, this);
+        v->left = nullptr;
+        return result;
+    }
+    return share(v->left);
+}
 
-        } else if (!pos2->left) {
-            return pos2->right;
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::node_ptr
+persistent_set<T, Balance, RefCount, Allocator, Compare>::right_of(node_ptr const &v) const {
+    if (v.exclusive()) {
+        node_ptr result(v->right, this);
+        v->right = nullptr;
+        return result;
+    }
+    return share(v->right);
+}
 
-        } else {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode *
+persistent_set<T, Balance, RefCount, Allocator, Compare>::make_root(node_ptr left) const {
+    root_allocator a(alloc);
+    bNode *result = std::allocator_traits<root_allocator>::allocate(a, 1);
+    std::allocator_traits<root_allocator>::construct(a, result);
+    result->left = left.take();
+    return result;
+}
 
-            bNode *minimum = pos->right->min();
-            return std::make_shared<typename persistent_set<T>::node>
-                    (pos->left, erase_impl(pos->right.get(), minimum), minimum->get_value());
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::release(bNode *v) const {
+    if (v && RefCount::release(v->refs)) {
+        for (bNode *cur = v; cur;) {
+            cur = release_step(cur);
         }
+    }
+}
 
-    } else if (pos->get_value() < pos2->get_value()) {
-        return std::make_shared<typename persistent_set<T>::node>
-                (pos->left, erase_impl(pos->right.get(), pos2), pos->get_value());
-    } else {
-        return std::make_shared<typename persistent_set<T>::node>
-                (erase_impl(pos->left.get(), pos2), pos->right, pos->get_value());
+// One step of freeing the subtree of a node whose last reference is gone. A dying left
+// child is rotated above its parent (which gets a reference back so it is released again
+// later); otherwise the node itself is freed and its right child is visited next. Freeing a
+// subtree therefore takes constant stack and can be stopped and resumed between steps.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode *
+persistent_set<T, Balance, RefCount, Allocator, Compare>::release_step(bNode *cur) const {
+    bNode *left = cur->left;
+    if (left && RefCount::release(left->refs)) {
+        cur->left = left->right;
+        RefCount::acquire(cur->refs);
+        left->right = cur;
+        return left;
     }
+    bNode *right = cur->right;
+    destroy(cur);
+    return right && RefCount::release(right->refs) ? right : nullptr;
 }
 
-template<typename T>
-void persistent_set<T>::tree_() {
-    if (!tree)
-        tree = std::make_shared<bNode>();
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::destroy(bNode *v) const {
+    node_allocator a(alloc);
+    if constexpr (shared_values) {
+        release_cell(static_cast<node *>(v)->value);
+    }
+    std::allocator_traits<node_allocator>::destroy(a, static_cast<node *>(v));
+    std::allocator_traits<node_allocator>::deallocate(a, static_cast<node *>(v), 1);
 }
 
-template<typename T>
-persistent_set<T>::persistent_set(persistent_set const &other) {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::release_tree(bNode *root) const {
+    if (root && RefCount::release(root->refs)) {
+        if (reclaim && root->left) {
+            reclaim->defer(root->left);
+        } else {
+            release(root->left);
+        }
+        root_allocator a(alloc);
+        std::allocator_traits<root_allocator>::destroy(a, root);
+        std::allocator_traits<root_allocator>::deallocate(a, root, 1);
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::persistent_set(persistent_set const &other)
+        : alloc(other.alloc), comp(other.comp) {
+    static_assert(copyable_nodes, "versions share nodes, which path copying copies");
     tree = other.tree;
     _size = other._size;
+    reclaim = other.reclaim;
+    if (tree)
+        RefCount::acquire(tree->refs);
 }
 
-template<typename T>
-bool persistent_set<T>::empty() const {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::persistent_set(persistent_set &&other) noexcept
+        : alloc(other.alloc), comp(other.comp) {
+    tree = other.tree;
+    _size = other._size;
+    reclaim = other.reclaim;
+    other.tree = nullptr;
+    other._size = 0;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare> &persistent_set<T, Balance, RefCount, Allocator, Compare>::operator=(persistent_set const &other) {
+    persistent_set tmp(other);
+    swap(tmp);
+    return *this;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare> &persistent_set<T, Balance, RefCount, Allocator, Compare>::operator=(persistent_set &&other) noexcept {
+    persistent_set tmp(std::move(other));
+    swap(tmp);
+    return *this;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::~persistent_set() {
+    release_tree(tree);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+bool persistent_set<T, Balance, RefCount, Allocator, Compare>::empty() const {
     return _size == 0;
 }
 
-template<typename T>
-void persistent_set<T>::clear() {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+size_t persistent_set<T, Balance, RefCount, Allocator, Compare>::size() const {
+    return _size;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::clear() {
+    release_tree(tree);
     tree = nullptr;
     _size = 0;
 }
 
-template<typename T>
-void swap(persistent_set<T> &a, persistent_set<T> &b) {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void swap(persistent_set<T, Balance, RefCount, Allocator, Compare> &a, persistent_set<T, Balance, RefCount, Allocator, Compare> &b) {
     a.swap(b);
 }
 
-template<typename T>
-T &persistent_set<T>::bNode::get_value() {
-    return static_cast<node *>(this)->value;
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+T &persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode::get_value() {
+    if constexpr (shared_values) {
+        return static_cast<node *>(this)->value->value;
+    } else {
+        return static_cast<node *>(this)->value;
+    }
 }
 
-template<typename T>
-persistent_set<T>::bNode::bNode() {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode::bNode() : meta(), refs(1) {
     left = nullptr;
+    right = nullptr;
+    Balance::update(meta, nullptr, nullptr);
 }
 
-template<typename T>
-typename persistent_set<T>::bNode *persistent_set<T>::bNode::min() {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode *persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode::min() {
     auto cur = this;
     while (cur->left != nullptr) {
-        cur = cur->left.get();
+        cur = cur->left;
     }
     return cur;
 }
 
-template<typename T>
-typename persistent_set<T>::bNode *persistent_set<T>::bNode::max() {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode *persistent_set<T, Balance, RefCount, Allocator, Compare>::bNode::max() {
     auto cur = this;
     while (cur->right != nullptr) {
-        cur = cur->right.get();
+        cur = cur->right;
     }
     return cur;
 }
 
-template<typename T>
-typename persistent_set<T>::iterator &persistent_set<T>::iterator::operator++() {
-    _node = _node->next(root);
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::iterator(iterator const &other)
+        : _node(other._node), root(other.root), depth(other.depth) {
+    std::copy(other.path, other.path + depth, path);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator &
+persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::operator=(iterator const &other) {
+    _node = other._node;
+    root = other.root;
+    depth = other.depth;
+    std::copy(other.path, other.path + depth, path);
     return *this;
 }
 
-template<typename T>
-typename persistent_set<T>::iterator persistent_set<T>::iterator::operator++(int) {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator &persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::operator++() {
+    if (_node->right) {
+        push(_node);
+        leftmost(_node->right);
+    } else {
+        bNode *child = _node;
+        while (depth > 0 && path[depth - 1]->right == child) {
+            child = path[--depth];
+        }
+        _node = depth > 0 ? path[--depth] : root;
+    }
+    return *this;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::operator++(int) {
     iterator copy = *this;
     ++*this;
     return copy;
 }
 
-template<typename T>
-typename persistent_set<T>::iterator &persistent_set<T>::iterator::operator--() {
-    _node = _node->prev(root);
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator &persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::operator--() {
+    if (_node == root) {
+        depth = 0;
+        rightmost(root->left);
+        return *this;
+    }
+    if (_node->left) {
+        push(_node);
+        rightmost(_node->left);
+    } else {
+        bNode *child = _node;
+        while (depth > 0 && path[depth - 1]->left == child) {
+            child = path[--depth];
+        }
+        _node = depth > 0 ? path[--depth] : root;
+    }
     return *this;
 }
 
-template<typename T>
-typename persistent_set<T>::iterator persistent_set<T>::iterator::operator--(int) {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::operator--(int) {
     iterator copy = *this;
     --*this;
     return copy;
 }
 
-template<typename T>
-typename persistent_set<T>::iterator::reference &persistent_set<T>::iterator::operator*() const {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::push(bNode *v) {
+    assert(depth < Balance::max_height);
+    path[depth++] = v;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::leftmost(bNode *v) {
+    while (v->left) {
+        push(v);
+        v = v->left;
+    }
+    _node = v;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::rightmost(bNode *v) {
+    while (v->right) {
+        push(v);
+        v = v->right;
+    }
+    _node = v;
+}
+
+// Keeps the node that insert() placed and its ancestors, bottom-up in path, up to date
+// while rebuild() turns `src` into `v` on the way back up. A rebuilt node holds the placed
+// one if a child of it is on the path; the entries above that child were moved by the
+// rotation and are dropped. Rotations only rebuild nodes near the top of the path.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::follow(bNode *src, bNode *v) {
+    if (src == _node) {
+        _node = v;
+        depth = 0;
+        return;
+    }
+    for (size_t i = depth; i-- > 0;) {
+        if (path[i] == v->left || path[i] == v->right) {
+            depth = i + 1;
+            push(v);
+            return;
+        }
+    }
+    if (_node == v->left || _node == v->right) {
+        depth = 0;
+        push(v);
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::reference &persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::operator*() const {
     return _node->get_value();
 }
 
-template<typename T>
-typename persistent_set<T>::iterator::pointer persistent_set<T>::iterator::operator->() const {
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::pointer persistent_set<T, Balance, RefCount, Allocator, Compare>::iterator::operator->() const {
     return &_node->get_value();
 }
 
-#endif
\ No newline at end of file
+// Holds the latest version of a set for threads that share it: load() returns that version
+// and store() or compare_exchange() publishes a new one, without locks. The version lives in
+// a record, and the cell word packs the record's slot in a small table with a count of loads
+// in progress (split reference count): a load bumps the count to pin the record while it
+// copies the set out, then takes the bump back, or, if the record was replaced meanwhile,
+// releases the reference that the writer added to the record for it. So readers only touch
+// the cell word, and a record is freed by whichever thread drops its last reference. Slots
+// rather than addresses go into the word, so nothing depends on how many bits a platform's
+// pointers use; a writer waits for a slot only while 63 replaced records are still pinned.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+struct persistent_set_cell {
+    static_assert(RefCount::thread_safe, "versions shared between threads need a thread-safe RefCount policy");
+
+    typedef persistent_set<T, Balance, RefCount, Allocator, Compare> set_type;
+
+    persistent_set_cell();
+
+    explicit persistent_set_cell(set_type const &value);
+
+    persistent_set_cell(persistent_set_cell const &) = delete;
+
+    persistent_set_cell &operator=(persistent_set_cell const &) = delete;
+
+    ~persistent_set_cell();
+
+    set_type load() const;
+
+    void store(set_type const &value);
+
+    // Publishes `desired` if the cell still holds `expected`; otherwise loads the current
+    // version into `expected`.
+    bool compare_exchange(set_type &expected, set_type const &desired);
+
+private:
+    struct record {
+        record(set_type const &value, unsigned slot) : refs(0), slot(slot), value(value) {}
+
+        // References beyond the cell's own; goes negative while pinned loads drop theirs
+        // before the writer that replaced the record has added them.
+        std::atomic<std::int64_t> refs;
+        unsigned slot;
+        set_type value;
+    };
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<record> record_allocator;
+
+    static constexpr unsigned slots = 64;
+    // The slot is in the high half of the word and the count in the low half.
+    static constexpr unsigned slot_shift = 32;
+    static constexpr std::uint64_t one = 1;
+
+    static std::uint64_t word_of(record *r);
+
+    record *record_of(std::uint64_t word) const;
+
+    record *make_record(set_type const &value);
+
+    void destroy(record *r) const;
+
+    record *pin() const;
+
+    void unpin(record *r) const;
+
+    void drop(record *r, std::int64_t n) const;
+
+    void retire(std::uint64_t word);
+
+    mutable std::atomic<std::uint64_t> word;
+    // A slot is taken until its record is freed, so a pinned slot always names the same record.
+    record *table[slots];
+    mutable std::atomic<std::uint64_t> vacant;
+    mutable record_allocator alloc;
+};
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::persistent_set_cell() : vacant(~std::uint64_t(0)), alloc() {
+    word.store(word_of(make_record(set_type())), std::memory_order_release);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::persistent_set_cell(set_type const &value)
+        : vacant(~std::uint64_t(0)), alloc(value.alloc) {
+    word.store(word_of(make_record(value)), std::memory_order_release);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::~persistent_set_cell() {
+    destroy(record_of(word.load(std::memory_order_acquire)));
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::set_type
+persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::load() const {
+    record *r = pin();
+    set_type result(r->value);
+    unpin(r);
+    return result;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::store(set_type const &value) {
+    record *fresh = make_record(value);
+    retire(word.exchange(word_of(fresh), std::memory_order_acq_rel));
+}
+
+// The new record is made before pinning the current one, so no writer waits for a slot
+// while it holds a pin.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+bool persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::compare_exchange(set_type &expected,
+                                                                                    set_type const &desired) {
+    record *fresh = make_record(desired);
+    record *r = pin();
+    // A version is identified by its sentinel, which `expected` keeps alive.
+    if (r->value.tree != expected.tree) {
+        expected = r->value;
+        unpin(r);
+        destroy(fresh);
+        return false;
+    }
+    std::uint64_t w = word.load(std::memory_order_relaxed);
+    while (w >> slot_shift == r->slot) {
+        if (word.compare_exchange_weak(w, word_of(fresh), std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            // Our own pin is among the loads in progress; retiring drops it with the record.
+            retire(w - one);
+            return true;
+        }
+    }
+    destroy(fresh);
+    drop(r, 1);
+    expected = load();
+    return false;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+std::uint64_t persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::word_of(record *r) {
+    return static_cast<std::uint64_t>(r->slot) << slot_shift;
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::record *
+persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::record_of(std::uint64_t word) const {
+    return table[word >> slot_shift];
+}
+
+// Makes a record in a vacant slot, waiting for one if all are taken.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::record *
+persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::make_record(set_type const &value) {
+    record *result = std::allocator_traits<record_allocator>::allocate(alloc, 1);
+    for (unsigned slot = 0;; slot = (slot + 1) % slots) {
+        std::uint64_t bit = one << slot;
+        if (slot == 0 && vacant.load(std::memory_order_relaxed) == 0) {
+            std::this_thread::yield();
+        } else if ((vacant.load(std::memory_order_relaxed) & bit) &&
+                   (vacant.fetch_and(~bit, std::memory_order_acquire) & bit)) {
+            try {
+                std::allocator_traits<record_allocator>::construct(alloc, result, value, slot);
+            } catch (...) {
+                vacant.fetch_or(bit, std::memory_order_release);
+                std::allocator_traits<record_allocator>::deallocate(alloc, result, 1);
+                throw;
+            }
+            table[slot] = result;
+            return result;
+        }
+    }
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::destroy(record *r) const {
+    std::uint64_t bit = one << r->slot;
+    std::allocator_traits<record_allocator>::destroy(alloc, r);
+    std::allocator_traits<record_allocator>::deallocate(alloc, r, 1);
+    vacant.fetch_or(bit, std::memory_order_release);
+}
+
+// Pins the current record; it stays alive until unpin().
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+typename persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::record *
+persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::pin() const {
+    return record_of(word.fetch_add(one, std::memory_order_acquire));
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::unpin(record *r) const {
+    std::uint64_t w = word.load(std::memory_order_relaxed);
+    while (w >> slot_shift == r->slot) {
+        if (word.compare_exchange_weak(w, w - one, std::memory_order_release, std::memory_order_relaxed))
+            return;
+    }
+    // Replaced while pinned: the writer turned the pin into a reference to the record.
+    drop(r, 1);
+}
+
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::drop(record *r, std::int64_t n) const {
+    if (r->refs.fetch_sub(n, std::memory_order_acq_rel) == n)
+        destroy(r);
+}
+
+// Gives up the cell's reference to the record in a word just replaced, handing the loads
+// still pinning it one reference each.
+template<typename T, typename Balance, typename RefCount, typename Allocator, typename Compare>
+void persistent_set_cell<T, Balance, RefCount, Allocator, Compare>::retire(std::uint64_t word) {
+    record *r = record_of(word);
+    std::int64_t pinned = static_cast<std::int64_t>(word & ((one << slot_shift) - 1));
+    if (r->refs.fetch_add(pinned, std::memory_order_acq_rel) == -pinned)
+        destroy(r);
+}
+
+#endif
@@ -0,0 +1,273 @@
+#ifndef PERSISTENT_SET_SNAPSHOT_H
+#define PERSISTENT_SET_SNAPSHOT_H
+
+#include "persistent_set.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PERSISTENT_SET_SNAPSHOT_MMAP 1
+#endif
+
+// Snapshot files of a set version: a fixed header and the elements in increasing order, as
+// raw bytes. A snapshot is queried in place, from a read-only mapping of the file or from
+// any buffer holding it, without building nodes: lookups bisect the array and iteration
+// walks it, so opening one costs page faults rather than inserts. thaw() turns it back into
+// a persistent_set in O(n) through from_sorted. T must be trivially copyable, and files are
+// only read on machines with the same byte order and sizeof(T).
+struct snapshot_header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t value_size;
+    std::uint64_t count;
+    std::uint64_t data_offset;
+
+    static constexpr char signature[8] = {'P', 'S', 'E', 'T', 'S', 'N', 'A', 'P'};
+    static constexpr std::uint32_t current_version = 1;
+    static constexpr std::uint32_t native_order = 0x01020304;
+    // Elements start at this offset, which suits any alignment up to a cache line.
+    static constexpr std::uint64_t aligned_offset = 64;
+};
+
+// Writes the elements of `set` to a new snapshot file at `path`.
+template<typename Set>
+void save_snapshot(Set const &set, char const *path) {
+    typedef typename Set::value_type T;
+    static_assert(std::is_trivially_copyable<T>::value, "snapshots store elements as raw bytes");
+    static_assert(alignof(T) <= snapshot_header::aligned_offset, "snapshot elements are 64-byte aligned");
+
+    std::FILE *file = std::fopen(path, "wb");
+    if (!file) {
+        throw std::system_error(errno, std::generic_category(), "save_snapshot: cannot create file");
+    }
+    snapshot_header header = {};
+    std::memcpy(header.magic, snapshot_header::signature, sizeof(header.magic));
+    header.version = snapshot_header::current_version;
+    header.byte_order = snapshot_header::native_order;
+    header.value_size = sizeof(T);
+    header.count = set.size();
+    header.data_offset = snapshot_header::aligned_offset;
+
+    char padding[snapshot_header::aligned_offset] = {};
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(padding, snapshot_header::aligned_offset - sizeof(header), 1, file) == 1;
+    for (auto it = set.begin(); ok && it != set.end(); ++it) {
+        ok = std::fwrite(&*it, sizeof(T), 1, file) == 1;
+    }
+    int error = errno;
+    if (std::fclose(file) != 0 && ok) {
+        error = errno;
+        ok = false;
+    }
+    if (!ok) {
+        std::remove(path);
+        throw std::system_error(error, std::generic_category(), "save_snapshot: write failed");
+    }
+}
+
+template<typename T, typename Compare = std::less<T>>
+struct set_snapshot {
+    static_assert(std::is_trivially_copyable<T>::value, "snapshots store elements as raw bytes");
+
+    typedef T value_type;
+    typedef T const *iterator;
+    typedef T const *const_iterator;
+
+    // A snapshot held in memory by the caller, who keeps it alive and unchanged.
+    set_snapshot(void const *data, size_t size, Compare const &comp = Compare());
+
+#if PERSISTENT_SET_SNAPSHOT_MMAP
+    // Maps the snapshot file at `path` read-only for the lifetime of this object.
+    explicit set_snapshot(char const *path, Compare const &comp = Compare());
+#endif
+
+    set_snapshot(set_snapshot &&other) noexcept;
+
+    set_snapshot &operator=(set_snapshot &&other) noexcept;
+
+    set_snapshot(set_snapshot const &) = delete;
+
+    set_snapshot &operator=(set_snapshot const &) = delete;
+
+    ~set_snapshot();
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    size_t size() const;
+
+    bool empty() const;
+
+    iterator find(T const &value) const;
+
+    size_t count(T const &value) const;
+
+    iterator lower_bound(T const &value) const;
+
+    iterator upper_bound(T const &value) const;
+
+    // A persistent_set (or another set type with from_sorted) holding the same elements.
+    template<typename Set = persistent_set<T, avl_balance, atomic_refcount, std::allocator<T>, Compare>>
+    Set thaw(typename Set::allocator_type const &alloc = typename Set::allocator_type()) const;
+
+private:
+    void attach(void const *data, size_t size);
+
+    T const *first;
+    T const *last;
+    // The mapping owned by this snapshot, if any.
+    void *mapping;
+    size_t mapping_size;
+    Compare comp;
+};
+
+template<typename T, typename Compare>
+set_snapshot<T, Compare>::set_snapshot(void const *data, size_t size, Compare const &comp)
+        : first(nullptr), last(nullptr), mapping(nullptr), mapping_size(0), comp(comp) {
+    attach(data, size);
+}
+
+#if PERSISTENT_SET_SNAPSHOT_MMAP
+template<typename T, typename Compare>
+set_snapshot<T, Compare>::set_snapshot(char const *path, Compare const &comp)
+        : first(nullptr), last(nullptr), mapping(nullptr), mapping_size(0), comp(comp) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "set_snapshot: cannot open file");
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "set_snapshot: cannot stat file");
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void *p = size ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    int error = errno;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        if (!size) {
+            throw std::runtime_error("set_snapshot: empty file");
+        }
+        throw std::system_error(error, std::generic_category(), "set_snapshot: cannot map file");
+    }
+    mapping = p;
+    mapping_size = size;
+    try {
+        attach(p, size);
+    } catch (...) {
+        ::munmap(mapping, mapping_size);
+        throw;
+    }
+}
+#endif
+
+template<typename T, typename Compare>
+set_snapshot<T, Compare>::set_snapshot(set_snapshot &&other) noexcept
+        : first(other.first), last(other.last), mapping(other.mapping), mapping_size(other.mapping_size),
+          comp(other.comp) {
+    other.mapping = nullptr;
+    other.first = other.last = nullptr;
+}
+
+template<typename T, typename Compare>
+set_snapshot<T, Compare> &set_snapshot<T, Compare>::operator=(set_snapshot &&other) noexcept {
+    std::swap(first, other.first);
+    std::swap(last, other.last);
+    std::swap(mapping, other.mapping);
+    std::swap(mapping_size, other.mapping_size);
+    std::swap(comp, other.comp);
+    return *this;
+}
+
+template<typename T, typename Compare>
+set_snapshot<T, Compare>::~set_snapshot() {
+#if PERSISTENT_SET_SNAPSHOT_MMAP
+    if (mapping) {
+        ::munmap(mapping, mapping_size);
+    }
+#endif
+}
+
+// Checks the header and locates the elements.
+template<typename T, typename Compare>
+void set_snapshot<T, Compare>::attach(void const *data, size_t size) {
+    snapshot_header header;
+    if (size < sizeof(header)) {
+        throw std::runtime_error("set_snapshot: truncated header");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, snapshot_header::signature, sizeof(header.magic)) != 0 ||
+        header.version != snapshot_header::current_version) {
+        throw std::runtime_error("set_snapshot: not a snapshot of a supported version");
+    }
+    if (header.byte_order != snapshot_header::native_order || header.value_size != sizeof(T)) {
+        throw std::runtime_error("set_snapshot: written for another byte order or element type");
+    }
+    char const *base = static_cast<char const *>(data);
+    if (header.data_offset > size || header.count > (size - header.data_offset) / sizeof(T) ||
+        reinterpret_cast<std::uintptr_t>(base + header.data_offset) % alignof(T) != 0) {
+        throw std::runtime_error("set_snapshot: truncated or misaligned data");
+    }
+    first = reinterpret_cast<T const *>(base + header.data_offset);
+    last = first + header.count;
+}
+
+template<typename T, typename Compare>
+typename set_snapshot<T, Compare>::iterator set_snapshot<T, Compare>::begin() const {
+    return first;
+}
+
+template<typename T, typename Compare>
+typename set_snapshot<T, Compare>::iterator set_snapshot<T, Compare>::end() const {
+    return last;
+}
+
+template<typename T, typename Compare>
+size_t set_snapshot<T, Compare>::size() const {
+    return static_cast<size_t>(last - first);
+}
+
+template<typename T, typename Compare>
+bool set_snapshot<T, Compare>::empty() const {
+    return first == last;
+}
+
+template<typename T, typename Compare>
+typename set_snapshot<T, Compare>::iterator set_snapshot<T, Compare>::find(T const &value) const {
+    iterator it = lower_bound(value);
+    return it != last && !comp(value, *it) ? it : last;
+}
+
+template<typename T, typename Compare>
+size_t set_snapshot<T, Compare>::count(T const &value) const {
+    return find(value) != last;
+}
+
+template<typename T, typename Compare>
+typename set_snapshot<T, Compare>::iterator set_snapshot<T, Compare>::lower_bound(T const &value) const {
+    return std::lower_bound(first, last, value, comp);
+}
+
+template<typename T, typename Compare>
+typename set_snapshot<T, Compare>::iterator set_snapshot<T, Compare>::upper_bound(T const &value) const {
+    return std::upper_bound(first, last, value, comp);
+}
+
+template<typename T, typename Compare>
+template<typename Set>
+Set set_snapshot<T, Compare>::thaw(typename Set::allocator_type const &alloc) const {
+    return Set::from_sorted(first, last, comp, alloc);
+}
+
+#endif